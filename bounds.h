@@ -31,6 +31,9 @@
 #include "display.h"
 #include "vectors.h"
 
+#include <algorithm>
+#include <limits>
+
 class Bounds2D {
 public:
     vec2 min;
@@ -124,6 +127,44 @@ public:
         return true;
     }
 
+    // squared distance from the point to the closest point in the bounds
+    float distance2(const vec2& point) const {
+        float dx = std::max(0.0f, std::max(min.x - point.x, point.x - max.x));
+        float dy = std::max(0.0f, std::max(min.y - point.y, point.y - max.y));
+
+        return dx*dx + dy*dy;
+    }
+
+    // slab test. if the ray hits, distance is set to where it enters the
+    // bounds as a multiple of dir, or 0 if the origin is inside
+    bool intersects(const vec2& origin, const vec2& dir, float& distance) const {
+        if(first) return false;
+
+        float tmin = 0.0f;
+        float tmax = std::numeric_limits<float>::max();
+
+        for(int i=0;i<2;i++) {
+            if(dir[i] == 0.0f) {
+                if(origin[i] < min[i] || origin[i] > max[i]) return false;
+                continue;
+            }
+
+            float t1 = (min[i] - origin[i]) / dir[i];
+            float t2 = (max[i] - origin[i]) / dir[i];
+
+            if(t1 > t2) std::swap(t1, t2);
+
+            tmin = std::max(tmin, t1);
+            tmax = std::min(tmax, t2);
+
+            if(tmin > tmax) return false;
+        }
+
+        distance = tmin;
+
+        return true;
+    }
+
     void draw() const{
         glBegin(GL_LINE_STRIP);
             glVertex2fv(glm::value_ptr(min));
@@ -0,0 +1,205 @@
+/*
+    Copyright (c) 2026 Andrew Caudwell (acaudwell@gmail.com)
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. The name of the author may not be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "frame_queue.h"
+
+#include "SDL.h"
+
+#include <algorithm>
+
+#define FRAME_QUEUE_MAX_WORKERS 8
+
+FrameQueue::FrameQueue(FrameEncoder* encoder, size_t frame_size, int worker_count)
+    : encoder(encoder) {
+
+#if SDL_VERSION_ATLEAST(2,0,0)
+    if(worker_count <= 0) worker_count = std::min(FRAME_QUEUE_MAX_WORKERS, SDL_GetCPUCount());
+#else
+    if(worker_count <= 0) worker_count = 1;
+#endif
+
+    worker_count = std::max(1, worker_count);
+
+    // a slot for each worker plus one being captured and one waiting to be written
+    slots.resize(worker_count + 2);
+
+    for(size_t i = 0; i < slots.size(); i++) {
+        slots[i].pixels.resize(frame_size);
+    }
+
+    next_capture = 0;
+    next_encode  = 0;
+    next_write   = 0;
+
+    writing = false;
+    exiting = false;
+
+    mutex     = SDL_CreateMutex();
+    work_cond = SDL_CreateCond();
+    free_cond = SDL_CreateCond();
+
+    for(int i = 0; i < worker_count; i++) {
+#if SDL_VERSION_ATLEAST(2,0,0)
+        SDL_Thread* thread = SDL_CreateThread( FrameQueue::startWorker, "frame_queue", this );
+#else
+        SDL_Thread* thread = SDL_CreateThread( FrameQueue::startWorker, this );
+#endif
+        if(thread != 0) workers.push_back(thread);
+    }
+}
+
+FrameQueue::~FrameQueue() {
+    stop();
+
+    SDL_DestroyCond(work_cond);
+    SDL_DestroyCond(free_cond);
+    SDL_DestroyMutex(mutex);
+}
+
+int FrameQueue::startWorker(void* queue) {
+    (static_cast<FrameQueue*>(queue))->run();
+    return 0;
+}
+
+std::vector<char>& FrameQueue::beginFrame() {
+
+    FrameQueueSlot& slot = slots[next_capture % slots.size()];
+
+    SDL_mutexP(mutex);
+
+        while(slot.state != FRAME_QUEUE_SLOT_FREE) {
+            SDL_CondWait(free_cond, mutex);
+        }
+
+    SDL_mutexV(mutex);
+
+    return slot.pixels;
+}
+
+void FrameQueue::endFrame() {
+
+    SDL_mutexP(mutex);
+
+        slots[next_capture % slots.size()].state = FRAME_QUEUE_SLOT_CAPTURED;
+        next_capture++;
+
+        SDL_CondSignal(work_cond);
+
+    SDL_mutexV(mutex);
+
+    // no workers running, process the frame on this thread
+    if(workers.empty()) {
+        SDL_mutexP(mutex);
+        processFrame();
+        SDL_mutexV(mutex);
+    }
+}
+
+// called with the mutex held. encodes the next captured frame then
+// writes any frames that are ready, unless another thread is writing
+
+void FrameQueue::processFrame() {
+
+    FrameQueueSlot& slot = slots[next_encode % slots.size()];
+    next_encode++;
+
+    slot.state = FRAME_QUEUE_SLOT_ENCODING;
+
+    SDL_mutexV(mutex);
+
+        encoder->encodeFrame(slot.pixels, slot.output);
+
+    SDL_mutexP(mutex);
+
+    slot.state = FRAME_QUEUE_SLOT_ENCODED;
+
+    if(!writing) writeFrames();
+}
+
+// called with the mutex held
+
+void FrameQueue::writeFrames() {
+
+    writing = true;
+
+    while(next_write < next_encode) {
+        FrameQueueSlot& slot = slots[next_write % slots.size()];
+
+        if(slot.state != FRAME_QUEUE_SLOT_ENCODED) break;
+
+        SDL_mutexV(mutex);
+
+            encoder->writeFrame(slot.pixels, slot.output);
+
+        SDL_mutexP(mutex);
+
+        slot.state = FRAME_QUEUE_SLOT_FREE;
+        next_write++;
+
+        SDL_CondSignal(free_cond);
+    }
+
+    writing = false;
+}
+
+void FrameQueue::run() {
+
+    SDL_mutexP(mutex);
+
+    while(true) {
+
+        while(next_encode == next_capture && !exiting) {
+            SDL_CondWait(work_cond, mutex);
+        }
+
+        // finish any captured frames before exiting
+        if(next_encode == next_capture) break;
+
+        processFrame();
+    }
+
+    SDL_mutexV(mutex);
+}
+
+void FrameQueue::stop() {
+    if(workers.empty()) return;
+
+    SDL_mutexP(mutex);
+
+        exiting = true;
+
+        SDL_CondBroadcast(work_cond);
+
+    SDL_mutexV(mutex);
+
+    for(size_t i = 0; i < workers.size(); i++) {
+        SDL_WaitThread(workers[i], 0);
+    }
+
+    workers.clear();
+}
@@ -0,0 +1,104 @@
+/*
+    Copyright (c) 2026 Andrew Caudwell (acaudwell@gmail.com)
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. The name of the author may not be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef CORE_FRAME_QUEUE_H
+#define CORE_FRAME_QUEUE_H
+
+#include "SDL_thread.h"
+
+#include <vector>
+#include <cstddef>
+
+// encodes captured frames on worker threads and writes them in order
+
+class FrameEncoder {
+public:
+    virtual ~FrameEncoder() {};
+
+    // called from any of the worker threads
+    virtual void encodeFrame(std::vector<char>& pixels, std::vector<char>& output) = 0;
+
+    // called in frame order, one frame at a time. the captured pixels
+    // are still available so they can be written without a copy
+    virtual void writeFrame(std::vector<char>& pixels, std::vector<char>& output) = 0;
+};
+
+enum frame_queue_slot_state { FRAME_QUEUE_SLOT_FREE, FRAME_QUEUE_SLOT_CAPTURED, FRAME_QUEUE_SLOT_ENCODING, FRAME_QUEUE_SLOT_ENCODED };
+
+class FrameQueueSlot {
+public:
+    std::vector<char> pixels;
+    std::vector<char> output;
+    int state;
+
+    FrameQueueSlot() : state(FRAME_QUEUE_SLOT_FREE) {};
+};
+
+class FrameQueue {
+protected:
+    FrameEncoder* encoder;
+
+    std::vector<FrameQueueSlot> slots;
+    std::vector<SDL_Thread*> workers;
+
+    SDL_mutex* mutex;
+    SDL_cond*  work_cond;
+    SDL_cond*  free_cond;
+
+    // frame numbers, the slot of a frame is frame % slots.size()
+    long long next_capture;
+    long long next_encode;
+    long long next_write;
+
+    bool writing;
+    bool exiting;
+
+    void writeFrames();
+    void processFrame();
+
+    static int startWorker(void* queue);
+public:
+    // worker_count of 0 uses one worker per CPU
+    FrameQueue(FrameEncoder* encoder, size_t frame_size, int worker_count = 0);
+    ~FrameQueue();
+
+    // returns the pixel buffer of the next frame, waiting for a free slot
+    // if the workers have fallen behind
+    std::vector<char>& beginFrame();
+    void endFrame();
+
+    void run();
+
+    // encode and write any remaining frames and stop the workers.
+    // frames added after stopping are processed immediately
+    void stop();
+
+    int getWorkerCount() const { return workers.size(); };
+};
+
+#endif
@@ -27,6 +27,25 @@
 
 #include "frustum.h"
 
+#include "SDL.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRUSTUM_SSE2
+#include <emmintrin.h>
+
+#if defined(_MSC_VER) || ((defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)))
+#define FRUSTUM_AVX
+#include <immintrin.h>
+#endif
+
+#endif
+
+#if defined(FRUSTUM_AVX) && !defined(_MSC_VER)
+#define FRUSTUM_TARGET_AVX __attribute__((target("avx")))
+#else
+#define FRUSTUM_TARGET_AVX
+#endif
+
 // Lighthouse 3D Frustum tutorial:
 // http://www.lighthouse3d.com/opengl/viewfrustum/index.php?gasource
 
@@ -104,6 +123,18 @@ void Frustum::updateView(const vec3& source, const vec3& target, const vec3& up)
 
     //far
     planes[5] = Plane(far_top_right,     far_top_left,      far_bottom_left);
+
+    updatePlaneArrays();
+}
+
+void Frustum::updatePlaneArrays() {
+
+    for(int i=0; i<6; i++) {
+        plane_nx[i] = planes[i].normal.x;
+        plane_ny[i] = planes[i].normal.y;
+        plane_nz[i] = planes[i].normal.z;
+        plane_d[i]  = planes[i].d;
+    }
 }
 
 bool Frustum::contains(const vec3& p) const {
@@ -151,3 +182,276 @@ bool Frustum::intersects(const Bounds2D& bounds, float z) const {
 }
 
 
+
+frustum_result Frustum::classify(const Bounds3D& bounds, unsigned int& plane_mask) const {
+
+    vec3 inner, outer;
+
+    for(int i=0; i<6; i++) {
+
+        unsigned int plane_bit = 1 << i;
+
+        if(!(plane_mask & plane_bit)) continue;
+
+        if(planes[i].normal.x > 0.0) { outer.x = bounds.max.x; inner.x = bounds.min.x; }
+        else                         { outer.x = bounds.min.x; inner.x = bounds.max.x; }
+
+        if(planes[i].normal.y > 0.0) { outer.y = bounds.max.y; inner.y = bounds.min.y; }
+        else                         { outer.y = bounds.min.y; inner.y = bounds.max.y; }
+
+        if(planes[i].normal.z > 0.0) { outer.z = bounds.max.z; inner.z = bounds.min.z; }
+        else                         { outer.z = bounds.min.z; inner.z = bounds.max.z; }
+
+        if(planes[i].distance(outer) < 0.0) return FRUSTUM_OUTSIDE;
+
+        if(planes[i].distance(inner) >= 0.0) plane_mask &= ~plane_bit;
+    }
+
+    return plane_mask == 0 ? FRUSTUM_INSIDE : FRUSTUM_INTERSECTS;
+}
+
+frustum_result Frustum::classify(const Bounds2D& bounds, unsigned int& plane_mask, float z) const {
+
+    vec3 inner, outer;
+
+    inner.z = outer.z = z;
+
+    for(int i=0; i<6; i++) {
+
+        unsigned int plane_bit = 1 << i;
+
+        if(!(plane_mask & plane_bit)) continue;
+
+        if(planes[i].normal.x > 0.0) { outer.x = bounds.max.x; inner.x = bounds.min.x; }
+        else                         { outer.x = bounds.min.x; inner.x = bounds.max.x; }
+
+        if(planes[i].normal.y > 0.0) { outer.y = bounds.max.y; inner.y = bounds.min.y; }
+        else                         { outer.y = bounds.min.y; inner.y = bounds.max.y; }
+
+        if(planes[i].distance(outer) < 0.0) return FRUSTUM_OUTSIDE;
+
+        if(planes[i].distance(inner) >= 0.0) plane_mask &= ~plane_bit;
+    }
+
+    return plane_mask == 0 ? FRUSTUM_INSIDE : FRUSTUM_INTERSECTS;
+}
+
+// Batch Tests
+
+// each kernel picks the corner of the box furthest along each plane normal,
+// the same as the single box tests, and returns a bit mask of the boxes
+// outside of any plane. the arithmetic is done in the same order so the
+// results match intersects() exactly
+
+#ifdef FRUSTUM_SSE2
+
+static inline int frustum_outside_mask_sse2(const float* nx, const float* ny, const float* nz, const float* d,
+                                            __m128 minx, __m128 miny, __m128 minz, __m128 maxx, __m128 maxy, __m128 maxz) {
+
+    __m128 zero    = _mm_setzero_ps();
+    __m128 outside = zero;
+
+    for(int i=0; i<6; i++) {
+        __m128 cx = nx[i] > 0.0 ? maxx : minx;
+        __m128 cy = ny[i] > 0.0 ? maxy : miny;
+        __m128 cz = nz[i] > 0.0 ? maxz : minz;
+
+        __m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(nx[i]), cx),
+                                                       _mm_mul_ps(_mm_set1_ps(ny[i]), cy)),
+                                            _mm_mul_ps(_mm_set1_ps(nz[i]), cz)),
+                                 _mm_set1_ps(d[i]));
+
+        outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, zero));
+    }
+
+    return _mm_movemask_ps(outside);
+}
+
+#endif
+
+#ifdef FRUSTUM_AVX
+
+static int frustum_has_avx() {
+#if SDL_VERSION_ATLEAST(2,0,2)
+    static int has_avx = -1;
+
+    if(has_avx == -1) has_avx = SDL_HasAVX() ? 1 : 0;
+
+    return has_avx;
+#else
+    return 0;
+#endif
+}
+
+FRUSTUM_TARGET_AVX
+static inline int frustum_outside_mask_avx(const float* nx, const float* ny, const float* nz, const float* d,
+                                           __m256 minx, __m256 miny, __m256 minz, __m256 maxx, __m256 maxy, __m256 maxz) {
+
+    __m256 zero    = _mm256_setzero_ps();
+    __m256 outside = zero;
+
+    for(int i=0; i<6; i++) {
+        __m256 cx = nx[i] > 0.0 ? maxx : minx;
+        __m256 cy = ny[i] > 0.0 ? maxy : miny;
+        __m256 cz = nz[i] > 0.0 ? maxz : minz;
+
+        __m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(nx[i]), cx),
+                                                                _mm256_mul_ps(_mm256_set1_ps(ny[i]), cy)),
+                                                  _mm256_mul_ps(_mm256_set1_ps(nz[i]), cz)),
+                                    _mm256_set1_ps(d[i]));
+
+        outside = _mm256_or_ps(outside, _mm256_cmp_ps(dist, zero, _CMP_LT_OQ));
+    }
+
+    return _mm256_movemask_ps(outside);
+}
+
+// min.x, min.y, max.x, max.y of each box are adjacent, so 4 boxes
+// can be loaded and transposed into one register per coordinate
+
+FRUSTUM_TARGET_AVX
+static size_t frustum_intersects_batch_2d_avx(const float* nx, const float* ny, const float* nz, const float* d,
+                                              const Bounds2D* boxes, size_t n, uint8_t* out, float z) {
+
+    __m256 bz = _mm256_set1_ps(z);
+
+    size_t i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        __m128 a0 = _mm_loadu_ps(&boxes[i  ].min.x);
+        __m128 a1 = _mm_loadu_ps(&boxes[i+1].min.x);
+        __m128 a2 = _mm_loadu_ps(&boxes[i+2].min.x);
+        __m128 a3 = _mm_loadu_ps(&boxes[i+3].min.x);
+        __m128 b0 = _mm_loadu_ps(&boxes[i+4].min.x);
+        __m128 b1 = _mm_loadu_ps(&boxes[i+5].min.x);
+        __m128 b2 = _mm_loadu_ps(&boxes[i+6].min.x);
+        __m128 b3 = _mm_loadu_ps(&boxes[i+7].min.x);
+
+        _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+        _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+
+        __m256 minx = _mm256_insertf128_ps(_mm256_castps128_ps256(a0), b0, 1);
+        __m256 miny = _mm256_insertf128_ps(_mm256_castps128_ps256(a1), b1, 1);
+        __m256 maxx = _mm256_insertf128_ps(_mm256_castps128_ps256(a2), b2, 1);
+        __m256 maxy = _mm256_insertf128_ps(_mm256_castps128_ps256(a3), b3, 1);
+
+        int outside = frustum_outside_mask_avx(nx, ny, nz, d, minx, miny, bz, maxx, maxy, bz);
+
+        for(int j=0; j<8; j++) {
+            out[i+j] = (outside >> j) & 1 ? 0 : 1;
+        }
+    }
+
+    return i;
+}
+
+FRUSTUM_TARGET_AVX
+static size_t frustum_intersects_batch_3d_avx(const float* nx, const float* ny, const float* nz, const float* d,
+                                              const Bounds3D* boxes, size_t n, uint8_t* out) {
+    size_t i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        const Bounds3D* b = boxes + i;
+
+        __m256 minx = _mm256_setr_ps(b[0].min.x, b[1].min.x, b[2].min.x, b[3].min.x, b[4].min.x, b[5].min.x, b[6].min.x, b[7].min.x);
+        __m256 miny = _mm256_setr_ps(b[0].min.y, b[1].min.y, b[2].min.y, b[3].min.y, b[4].min.y, b[5].min.y, b[6].min.y, b[7].min.y);
+        __m256 minz = _mm256_setr_ps(b[0].min.z, b[1].min.z, b[2].min.z, b[3].min.z, b[4].min.z, b[5].min.z, b[6].min.z, b[7].min.z);
+        __m256 maxx = _mm256_setr_ps(b[0].max.x, b[1].max.x, b[2].max.x, b[3].max.x, b[4].max.x, b[5].max.x, b[6].max.x, b[7].max.x);
+        __m256 maxy = _mm256_setr_ps(b[0].max.y, b[1].max.y, b[2].max.y, b[3].max.y, b[4].max.y, b[5].max.y, b[6].max.y, b[7].max.y);
+        __m256 maxz = _mm256_setr_ps(b[0].max.z, b[1].max.z, b[2].max.z, b[3].max.z, b[4].max.z, b[5].max.z, b[6].max.z, b[7].max.z);
+
+        int outside = frustum_outside_mask_avx(nx, ny, nz, d, minx, miny, minz, maxx, maxy, maxz);
+
+        for(int j=0; j<8; j++) {
+            out[i+j] = (outside >> j) & 1 ? 0 : 1;
+        }
+    }
+
+    return i;
+}
+
+#endif
+
+size_t Frustum::intersectsBatch(const Bounds2D* boxes, size_t n, uint8_t* out, float z) const {
+
+    size_t i = 0;
+
+#ifdef FRUSTUM_AVX
+    if(frustum_has_avx()) {
+        i = frustum_intersects_batch_2d_avx(plane_nx, plane_ny, plane_nz, plane_d, boxes, n, out, z);
+    }
+#endif
+
+#ifdef FRUSTUM_SSE2
+    __m128 bz = _mm_set1_ps(z);
+
+    for(; i + 4 <= n; i += 4) {
+        __m128 minx = _mm_loadu_ps(&boxes[i  ].min.x);
+        __m128 miny = _mm_loadu_ps(&boxes[i+1].min.x);
+        __m128 maxx = _mm_loadu_ps(&boxes[i+2].min.x);
+        __m128 maxy = _mm_loadu_ps(&boxes[i+3].min.x);
+
+        _MM_TRANSPOSE4_PS(minx, miny, maxx, maxy);
+
+        int outside = frustum_outside_mask_sse2(plane_nx, plane_ny, plane_nz, plane_d, minx, miny, bz, maxx, maxy, bz);
+
+        for(int j=0; j<4; j++) {
+            out[i+j] = (outside >> j) & 1 ? 0 : 1;
+        }
+    }
+#endif
+
+    for(; i < n; i++) {
+        out[i] = intersects(boxes[i], z) ? 1 : 0;
+    }
+
+    size_t count = 0;
+
+    for(i = 0; i < n; i++) {
+        count += out[i];
+    }
+
+    return count;
+}
+
+size_t Frustum::intersectsBatch(const Bounds3D* boxes, size_t n, uint8_t* out) const {
+
+    size_t i = 0;
+
+#ifdef FRUSTUM_AVX
+    if(frustum_has_avx()) {
+        i = frustum_intersects_batch_3d_avx(plane_nx, plane_ny, plane_nz, plane_d, boxes, n, out);
+    }
+#endif
+
+#ifdef FRUSTUM_SSE2
+    for(; i + 4 <= n; i += 4) {
+        const Bounds3D* b = boxes + i;
+
+        __m128 minx = _mm_setr_ps(b[0].min.x, b[1].min.x, b[2].min.x, b[3].min.x);
+        __m128 miny = _mm_setr_ps(b[0].min.y, b[1].min.y, b[2].min.y, b[3].min.y);
+        __m128 minz = _mm_setr_ps(b[0].min.z, b[1].min.z, b[2].min.z, b[3].min.z);
+        __m128 maxx = _mm_setr_ps(b[0].max.x, b[1].max.x, b[2].max.x, b[3].max.x);
+        __m128 maxy = _mm_setr_ps(b[0].max.y, b[1].max.y, b[2].max.y, b[3].max.y);
+        __m128 maxz = _mm_setr_ps(b[0].max.z, b[1].max.z, b[2].max.z, b[3].max.z);
+
+        int outside = frustum_outside_mask_sse2(plane_nx, plane_ny, plane_nz, plane_d, minx, miny, minz, maxx, maxy, maxz);
+
+        for(int j=0; j<4; j++) {
+            out[i+j] = (outside >> j) & 1 ? 0 : 1;
+        }
+    }
+#endif
+
+    for(; i < n; i++) {
+        out[i] = intersects(boxes[i]) ? 1 : 0;
+    }
+
+    size_t count = 0;
+
+    for(i = 0; i < n; i++) {
+        count += out[i];
+    }
+
+    return count;
+}
@@ -33,6 +33,13 @@
 #include "pi.h"
 #include "bounds.h"
 
+#include <cstddef>
+#include <stdint.h>
+
+enum frustum_result { FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTS, FRUSTUM_INSIDE };
+
+#define FRUSTUM_ALL_PLANES 0x3f
+
 class Frustum {
 
     float near_distance, far_distance;
@@ -50,6 +57,14 @@ class Frustum {
     vec3 far_bottom_left,  far_bottom_right;
 
     Plane planes[6];
+
+    // planes in structure of arrays layout for the batch tests
+    float plane_nx[6];
+    float plane_ny[6];
+    float plane_nz[6];
+    float plane_d[6];
+
+    void updatePlaneArrays();
 public:
     Frustum();
     Frustum(const vec3& source, const vec3& target, const vec3& up, float fov, float near_distance, float far_distance);
@@ -63,6 +78,17 @@ public:
 
     bool intersects(const Bounds3D& bounds) const;
     bool intersects(const Bounds2D& bounds, float z = 0.0) const;
+
+    // only the planes set in plane_mask are tested. planes the bounds are
+    // entirely inside of are cleared from the mask, so it can be passed on
+    // to tests of bounds contained by these bounds
+    frustum_result classify(const Bounds3D& bounds, unsigned int& plane_mask) const;
+    frustum_result classify(const Bounds2D& bounds, unsigned int& plane_mask, float z = 0.0) const;
+
+    // test an array of bounds, setting out[i] to 1 if boxes[i] intersects.
+    // returns the number of intersecting bounds
+    size_t intersectsBatch(const Bounds2D* boxes, size_t n, uint8_t* out, float z = 0.0) const;
+    size_t intersectsBatch(const Bounds3D* boxes, size_t n, uint8_t* out) const;
 };
 
 #endif
@@ -592,6 +592,9 @@ void FXFontManager::init() {
     if(FT_Init_FreeType( &library ))
         throw FXFontException("Failed to init FreeType");
     use_vbo = false;
+
+    // text is rebuilt every frame
+    font_vbo.setStreaming(true);
 }
 
 void FXFontManager::unload() {
@@ -0,0 +1,160 @@
+/*
+    Copyright (c) 2026 Andrew Caudwell (acaudwell@gmail.com)
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. The name of the author may not be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "pixel_reader.h"
+#include "display.h"
+
+#include <cstring>
+
+PixelReader::PixelReader(GLenum format, int components, int buffer_count)
+    : format(format) {
+
+    width  = display.width;
+    height = display.height;
+
+    frame_size = width * height * components;
+
+    use_pbo    = (GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object) && buffer_count > 1;
+    use_fences = GLEW_VERSION_3_2 || GLEW_ARB_sync;
+
+    if(!use_pbo) buffer_count = 1;
+
+    for(int i = 0; i < buffer_count; i++) {
+        buffers.push_back(use_pbo ? new VBO(GL_PIXEL_PACK_BUFFER) : 0);
+        fences.push_back(0);
+    }
+
+    next_read = 0;
+    pending   = 0;
+}
+
+PixelReader::~PixelReader() {
+    unload();
+
+    for(size_t i = 0; i < buffers.size(); i++) {
+        if(buffers[i] != 0) delete buffers[i];
+    }
+}
+
+void PixelReader::unload() {
+
+    for(size_t i = 0; i < buffers.size(); i++) {
+        if(fences[i] != 0) {
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+        if(buffers[i] != 0) buffers[i]->unload();
+    }
+
+    next_read = 0;
+    pending   = 0;
+}
+
+bool PixelReader::full() const {
+    return pending == (int) buffers.size();
+}
+
+bool PixelReader::empty() const {
+    return pending == 0;
+}
+
+void PixelReader::readPixels() {
+
+    // make room by dropping the oldest frame
+    if(full()) getPixels(0);
+
+    pending++;
+
+    // without a pack buffer the read happens when the pixels are collected
+    if(!use_pbo) return;
+
+    int index = next_read;
+    next_read = (next_read + 1) % buffers.size();
+
+    VBO* pbo = buffers[index];
+
+    pbo->bind();
+
+    if(pbo->capacity == 0) {
+        pbo->capacity = frame_size;
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, 0, GL_STREAM_READ);
+    }
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, format, GL_UNSIGNED_BYTE, 0);
+
+    pbo->unbind();
+
+    if(use_fences) fences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool PixelReader::getPixels(char* pixels) {
+
+    if(empty()) return false;
+
+    if(!use_pbo) {
+        pending--;
+
+        if(pixels != 0) {
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glReadPixels(0, 0, width, height, format, GL_UNSIGNED_BYTE, pixels);
+        }
+        return true;
+    }
+
+    int index = (next_read + buffers.size() - pending) % buffers.size();
+
+    pending--;
+
+    if(fences[index] != 0) {
+        while(glClientWaitSync(fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+
+        glDeleteSync(fences[index]);
+        fences[index] = 0;
+    }
+
+    if(pixels == 0) return true;
+
+    VBO* pbo = buffers[index];
+
+    pbo->bind();
+
+    void* mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+
+    if(mapped != 0) {
+        memcpy(pixels, mapped, frame_size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, frame_size, pixels);
+    }
+
+    pbo->unbind();
+
+    return true;
+}
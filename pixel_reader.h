@@ -0,0 +1,76 @@
+/*
+    Copyright (c) 2026 Andrew Caudwell (acaudwell@gmail.com)
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. The name of the author may not be used to endorse or promote products
+       derived from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+    IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+    OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+    IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+    NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+    THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef CORE_PIXEL_READER_H
+#define CORE_PIXEL_READER_H
+
+#include "gl.h"
+#include "vbo.h"
+
+#include <vector>
+
+// reads the framebuffer into a ring of pixel pack buffers so the copy
+// completes asynchronously. frames are collected in order once the ring
+// is full, by which time the GPU has usually finished with them.
+// without pixel buffer object support the pixels are read directly.
+
+class PixelReader {
+protected:
+    GLenum format;
+
+    int width;
+    int height;
+    size_t frame_size;
+
+    bool use_pbo;
+    bool use_fences;
+
+    std::vector<VBO*> buffers;
+    std::vector<GLsync> fences;
+
+    int next_read;
+    int pending;
+public:
+    PixelReader(GLenum format, int components, int buffer_count = 3);
+    ~PixelReader();
+
+    void unload();
+
+    size_t getFrameSize() const { return frame_size; };
+
+    bool full() const;
+    bool empty() const;
+
+    // start reading the current framebuffer
+    void readPixels();
+
+    // copy the oldest frame read into pixels. waits for the GPU if needed
+    bool getPixels(char* pixels);
+};
+
+#endif
@@ -28,14 +28,41 @@
 #include "png_writer.h"
 #include "display.h"
 
+#include "SDL.h"
+
 #include <iostream>
+#include <cstring>
+#include <algorithm>
 
 #define PNG_SKIP_SETJMP_CHECK
 #include <png.h>
+#include <zlib.h>
 
 PNGWriter::PNGWriter(int components)
     : components(components) {
     out = 0;
+
+    // use the libpng defaults
+    compression_level    = Z_DEFAULT_COMPRESSION;
+    compression_strategy = -1;
+    filter               = PNG_WRITER_FILTER_ADAPTIVE;
+    thread_count         = 1;
+}
+
+void PNGWriter::setCompressionLevel(int level) {
+    compression_level = level;
+}
+
+void PNGWriter::setCompressionStrategy(int strategy) {
+    compression_strategy = strategy;
+}
+
+void PNGWriter::setFilter(int filter) {
+    this->filter = filter;
+}
+
+void PNGWriter::setThreads(int thread_count) {
+    this->thread_count = thread_count;
 }
 
 bool PNGWriter::open(const std::string& filename) {
@@ -88,13 +115,32 @@ void png_writer_flush_data(png_structp png_ptr) {
     if (!out->flush()) png_error(png_ptr, "png_writer_flush_data error");
 }
 
-void PNGWriter::writePNG(std::vector<char>& buffer) {
+void png_writer_append_data(png_structp png_ptr, png_bytep data, png_size_t length) {
+    std::vector<char>* output = (std::vector<char>*) png_get_io_ptr(png_ptr);
+    output->insert(output->end(), (char*) data, (char*) data + length);
+}
+
+void png_writer_flush_memory(png_structp png_ptr) {
+}
+
+static int png_writer_filter_flags(int filter) {
+    switch(filter) {
+        case PNG_WRITER_FILTER_NONE:    return PNG_FILTER_NONE;
+        case PNG_WRITER_FILTER_SUB:     return PNG_FILTER_SUB;
+        case PNG_WRITER_FILTER_UP:      return PNG_FILTER_UP;
+        case PNG_WRITER_FILTER_AVERAGE: return PNG_FILTER_AVG;
+        case PNG_WRITER_FILTER_PAETH:   return PNG_FILTER_PAETH;
+    }
+    return PNG_ALL_FILTERS;
+}
+
+static void png_writer_encode(std::vector<char>& buffer, size_t components, int level, int strategy, int filter, void* io_ptr, png_rw_ptr write_fn, png_flush_ptr flush_fn) {
 
     png_structp png_ptr  = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
 
     if(!png_ptr) throw PNGExporterException("png_create_write_struct failed");
 
-    png_set_write_fn(png_ptr, out, png_writer_write_data, png_writer_flush_data);
+    png_set_write_fn(png_ptr, io_ptr, write_fn, flush_fn);
 
     png_infop info_ptr = png_create_info_struct(png_ptr);
 
@@ -108,6 +154,10 @@ void PNGWriter::writePNG(std::vector<char>& buffer) {
 
     png_set_IHDR(png_ptr, info_ptr, display.width, display.height, 8, colour_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
+    png_set_compression_level(png_ptr, level);
+    if(strategy != -1) png_set_compression_strategy(png_ptr, strategy);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, png_writer_filter_flags(filter));
+
     std::vector<png_bytep> rows(display.height);
     for (int i = 0; i < display.height; i++) {
         rows[i] = (png_bytep) &(buffer[(display.height-i-1) * components * display.width]);
@@ -120,110 +170,462 @@ void PNGWriter::writePNG(std::vector<char>& buffer) {
     png_destroy_write_struct(&png_ptr, &info_ptr);
 }
 
-// PNGExporter
+void PNGWriter::writePNG(std::vector<char>& buffer) {
 
-PNGExporter::PNGExporter(const std::string& filename) {
+    if(thread_count > 1) {
+        std::vector<char> output;
+        encodeStrips(buffer, output);
+        write(output);
+        return;
+    }
 
-    buffer1.resize(display.width * display.height * 3);
-    buffer2.resize(display.width * display.height * 3);
+    png_writer_encode(buffer, components, compression_level, compression_strategy, filter, out, png_writer_write_data, png_writer_flush_data);
+}
 
-    buffer_shared_ptr = 0;
+void PNGWriter::encodePNG(std::vector<char>& buffer, std::vector<char>& output) {
+    output.clear();
 
-    thread_state = PNG_EXPORTER_WAIT;
+    if(thread_count > 1) {
+        encodeStrips(buffer, output);
+        return;
+    }
 
-    cond   = SDL_CreateCond();
-    mutex  = SDL_CreateMutex();
+    png_writer_encode(buffer, components, compression_level, compression_strategy, filter, &output, png_writer_append_data, png_writer_flush_memory);
+}
 
-    if(filename == "-") {
-        writer.setOutputStream(&std::cout);
-    } else {
-       this->filename = filename;
+void PNGWriter::write(const std::vector<char>& data) {
+    if(!data.empty()) out->write(&(data[0]), data.size());
+}
 
-       if(!writer.open(filename)) {
-            throw PNGExporterException(filename);
+// Parallel Strips
+
+// the image is split into horizontal strips, like pigz each strip is
+// deflated separately using the end of the previous strip as a preset
+// dictionary. strips before the last end with a sync flush so they
+// can be joined into one zlib stream, the adler32 of which is combined
+// from the checksums of the strips
+
+#define PNG_WRITER_WINDOW_SIZE 32768
+
+class PNGWriterStrips {
+public:
+    const unsigned char* pixels;
+    size_t components;
+    size_t stride;
+    int width;
+    int height;
+
+    int level;
+    int strategy;
+    int filter;
+
+    int strip_count;
+    int strip_rows;
+
+    // filter type byte followed by the filtered row, top row first
+    size_t row_size;
+    std::vector<unsigned char> filtered;
+
+    std::vector< std::vector<unsigned char> > deflated;
+    std::vector<uLong> checksums;
+
+    bool deflating;
+    bool failed;
+
+    SDL_mutex* mutex;
+    int next_strip;
+
+    PNGWriterStrips() : next_strip(0) {
+        mutex = SDL_CreateMutex();
+    };
+
+    ~PNGWriterStrips() {
+        SDL_DestroyMutex(mutex);
+    };
+
+    int nextStrip() {
+        SDL_mutexP(mutex);
+
+            int i = next_strip++;
+
+        SDL_mutexV(mutex);
+
+        return i;
+    };
+};
+
+static inline int png_writer_paeth(int a, int b, int c) {
+    int p  = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if(pa <= pb && pa <= pc) return a;
+    if(pb <= pc) return b;
+    return c;
+}
+
+static void png_writer_filter_row(int filter, const unsigned char* row, const unsigned char* prev, size_t length, size_t bpp, unsigned char* out) {
+
+    out[0] = filter;
+    out++;
+
+    for(size_t i = 0; i < length; i++) {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev != 0 ? prev[i] : 0;
+        int c = (i >= bpp && prev != 0) ? prev[i - bpp] : 0;
+
+        switch(filter) {
+            case PNG_WRITER_FILTER_SUB:
+                out[i] = row[i] - a;
+                break;
+            case PNG_WRITER_FILTER_UP:
+                out[i] = row[i] - b;
+                break;
+            case PNG_WRITER_FILTER_AVERAGE:
+                out[i] = row[i] - ((a + b) >> 1);
+                break;
+            case PNG_WRITER_FILTER_PAETH:
+                out[i] = row[i] - png_writer_paeth(a, b, c);
+                break;
+            default:
+                out[i] = row[i];
+                break;
         }
     }
+}
 
-#if SDL_VERSION_ATLEAST(2,0,0)
-    thread = SDL_CreateThread( PNGExporter::startThread, "png_exporter", this );
-#else
-    thread = SDL_CreateThread( PNGExporter::startThread, this );
-#endif
+// try each filter and keep the one with the smallest sum of absolute
+// differences, the same heuristic as libpng
+
+static void png_writer_filter_adaptive(const unsigned char* row, const unsigned char* prev, size_t length, size_t bpp, unsigned char* out, unsigned char* scratch) {
+
+    unsigned long best_sum = 0;
+
+    for(int f = PNG_WRITER_FILTER_NONE; f <= PNG_WRITER_FILTER_PAETH; f++) {
+
+        unsigned char* candidate = f == PNG_WRITER_FILTER_NONE ? out : scratch;
+
+        png_writer_filter_row(f, row, prev, length, bpp, candidate);
+
+        unsigned long sum = 0;
+
+        for(size_t i = 1; i <= length; i++) {
+            sum += abs((signed char) candidate[i]);
+        }
+
+        if(f == PNG_WRITER_FILTER_NONE || sum < best_sum) {
+            best_sum = sum;
+            if(candidate != out) memcpy(out, candidate, length + 1);
+        }
+    }
 }
 
-PNGExporter::~PNGExporter() {
+static void png_writer_filter_strip(PNGWriterStrips* strips, int strip) {
 
-    stop();
+    int start = strip * strips->strip_rows;
+    int end   = std::min(strips->height, start + strips->strip_rows);
 
-    SDL_DestroyCond(cond);
-    SDL_DestroyMutex(mutex);
+    size_t length = strips->row_size - 1;
 
-    buffer_shared_ptr = 0;
+    std::vector<unsigned char> scratch;
+    if(strips->filter == PNG_WRITER_FILTER_ADAPTIVE) scratch.resize(strips->row_size);
 
-    if(!filename.empty()) {
-        writer.close();
+    for(int y = start; y < end; y++) {
+
+        // rows are stored bottom up
+        const unsigned char* row  = strips->pixels + (strips->height - 1 - y) * strips->stride;
+        const unsigned char* prev = y > 0 ? row + strips->stride : 0;
+
+        unsigned char* out = &(strips->filtered[y * strips->row_size]);
+
+        if(strips->filter == PNG_WRITER_FILTER_ADAPTIVE) {
+            png_writer_filter_adaptive(row, prev, length, strips->components, out, &(scratch[0]));
+        } else {
+            png_writer_filter_row(strips->filter, row, prev, length, strips->components, out);
+        }
     }
 }
 
-int PNGExporter::startThread(void *exporter) {
-    (static_cast<PNGExporter*>(exporter))->run();
+static void png_writer_deflate_strip(PNGWriterStrips* strips, int strip) {
+
+    size_t start = strip * strips->strip_rows * strips->row_size;
+    size_t end   = std::min(strips->filtered.size(), start + strips->strip_rows * strips->row_size);
+
+    bool last = strip == strips->strip_count - 1;
+
+    unsigned char* input = &(strips->filtered[start]);
+    size_t length = end - start;
+
+    strips->checksums[strip] = adler32(adler32(0L, Z_NULL, 0), input, length);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    if(deflateInit2(&stream, strips->level, Z_DEFLATED, -15, 8, strips->strategy) != Z_OK) {
+        strips->failed = true;
+        return;
+    }
+
+    if(strip > 0) {
+        size_t dictionary_length = std::min(start, (size_t) PNG_WRITER_WINDOW_SIZE);
+        deflateSetDictionary(&stream, input - dictionary_length, dictionary_length);
+    }
+
+    std::vector<unsigned char>& output = strips->deflated[strip];
+
+    // leave room for the sync flush marker
+    output.resize(deflateBound(&stream, length) + 16);
+
+    stream.next_in  = input;
+    stream.avail_in = length;
+
+    size_t used = 0;
+
+    while(true) {
+        stream.next_out  = &(output[used]);
+        stream.avail_out = output.size() - used;
+
+        int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+        used = output.size() - stream.avail_out;
+
+        if(result == Z_STREAM_ERROR) {
+            strips->failed = true;
+            break;
+        }
+
+        if(last ? result == Z_STREAM_END : (stream.avail_in == 0 && stream.avail_out > 0)) break;
+
+        output.resize(output.size() * 2);
+    }
+
+    output.resize(used);
+
+    deflateEnd(&stream);
+}
+
+static int png_writer_strip_thread(void* arg) {
+    PNGWriterStrips* strips = static_cast<PNGWriterStrips*>(arg);
+
+    int i;
+    while((i = strips->nextStrip()) < strips->strip_count) {
+        if(strips->deflating) png_writer_deflate_strip(strips, i);
+        else png_writer_filter_strip(strips, i);
+    }
+
     return 0;
 }
 
-void PNGExporter::run() {
+static void png_writer_run_strips(PNGWriterStrips* strips, int thread_count) {
 
-    SDL_mutexP(mutex);
+    strips->next_strip = 0;
 
-    while(thread_state != PNG_EXPORTER_EXIT) {
+    std::vector<SDL_Thread*> threads;
 
-        thread_state = PNG_EXPORTER_WAIT;
+    for(int i = 1; i < thread_count; i++) {
+#if SDL_VERSION_ATLEAST(2,0,0)
+        SDL_Thread* thread = SDL_CreateThread( png_writer_strip_thread, "png_writer", strips );
+#else
+        SDL_Thread* thread = SDL_CreateThread( png_writer_strip_thread, strips );
+#endif
+        if(thread != 0) threads.push_back(thread);
+    }
 
-        while (thread_state == PNG_EXPORTER_WAIT) {
-            SDL_CondWait(cond, mutex);
-        }
+    // this thread also takes part
+    png_writer_strip_thread(strips);
 
-        if (thread_state != PNG_EXPORTER_WRITE) break;
+    for(size_t i = 0; i < threads.size(); i++) {
+        SDL_WaitThread(threads[i], 0);
+    }
+}
 
-        if (buffer_shared_ptr != 0) {
-            writer.writePNG(*buffer_shared_ptr);
-        }
+static void png_writer_append_uint32(std::vector<char>& output, unsigned int value) {
+    output.push_back((char) ((value >> 24) & 0xff));
+    output.push_back((char) ((value >> 16) & 0xff));
+    output.push_back((char) ((value >> 8)  & 0xff));
+    output.push_back((char) (value & 0xff));
+}
+
+static void png_writer_append_chunk(std::vector<char>& output, const char* type, const unsigned char* data, size_t length) {
+
+    png_writer_append_uint32(output, length);
+
+    output.insert(output.end(), type, type + 4);
+    if(length > 0) output.insert(output.end(), (const char*) data, (const char*) data + length);
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef*) type, 4);
+    if(length > 0) crc = crc32(crc, data, length);
+
+    png_writer_append_uint32(output, crc);
+}
+
+void PNGWriter::encodeStrips(std::vector<char>& buffer, std::vector<char>& output) {
+
+    int width  = display.width;
+    int height = display.height;
+
+    PNGWriterStrips strips;
+    strips.pixels     = (const unsigned char*) &(buffer[0]);
+    strips.components = components;
+    strips.stride     = width * components;
+    strips.width      = width;
+    strips.height     = height;
+    strips.level      = compression_level;
+    strips.filter     = filter;
+    strips.deflating  = false;
+    strips.failed     = false;
+
+    // match the libpng default strategy
+    if(compression_strategy != -1) strips.strategy = compression_strategy;
+    else strips.strategy = filter == PNG_WRITER_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+
+    strips.strip_count = std::max(1, std::min(thread_count, height));
+    strips.strip_rows  = (height + strips.strip_count - 1) / strips.strip_count;
+    strips.strip_count = std::max(1, (height + strips.strip_rows - 1) / strips.strip_rows);
+
+    strips.row_size = strips.stride + 1;
+    strips.filtered.resize(strips.row_size * height);
+
+    strips.deflated.resize(strips.strip_count);
+    strips.checksums.resize(strips.strip_count);
+
+    int threads = std::min(thread_count, strips.strip_count);
+
+    png_writer_run_strips(&strips, threads);
+
+    strips.deflating = true;
+
+    png_writer_run_strips(&strips, threads);
+
+    if(strips.failed) throw PNGExporterException("deflate failed");
+
+    // signature
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    output.insert(output.end(), (const char*) signature, (const char*) signature + 8);
+
+    // header
+    unsigned char ihdr[13];
+    ihdr[0]  = (width >> 24) & 0xff;
+    ihdr[1]  = (width >> 16) & 0xff;
+    ihdr[2]  = (width >> 8)  & 0xff;
+    ihdr[3]  = width & 0xff;
+    ihdr[4]  = (height >> 24) & 0xff;
+    ihdr[5]  = (height >> 16) & 0xff;
+    ihdr[6]  = (height >> 8)  & 0xff;
+    ihdr[7]  = height & 0xff;
+    ihdr[8]  = 8;
+    ihdr[9]  = components == 4 ? 6 : 2;
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+
+    png_writer_append_chunk(output, "IHDR", ihdr, 13);
+
+    // zlib header with the compression level hint
+    int level_hint = 2;
+
+    if(compression_level >= 0) {
+        if(compression_level <= 1)      level_hint = 0;
+        else if(compression_level <= 5) level_hint = 1;
+        else if(compression_level == 6) level_hint = 2;
+        else                            level_hint = 3;
+    }
+
+    unsigned char zlib_header[2];
+    zlib_header[0] = 0x78;
+    zlib_header[1] = level_hint << 6;
+    zlib_header[1] += 31 - ((zlib_header[0] * 256 + zlib_header[1]) % 31);
+
+    std::vector<unsigned char>& first = strips.deflated[0];
+    first.insert(first.begin(), zlib_header, zlib_header + 2);
+
+    // checksum of the whole stream
+    uLong checksum = strips.checksums[0];
+
+    for(int i = 1; i < strips.strip_count; i++) {
+        size_t start  = i * strips.strip_rows * strips.row_size;
+        size_t length = std::min(strips.filtered.size() - start, strips.strip_rows * strips.row_size);
+
+        checksum = adler32_combine(checksum, strips.checksums[i], length);
     }
 
-    thread_state = PNG_EXPORTER_STOPPED;
+    std::vector<unsigned char>& last = strips.deflated[strips.strip_count - 1];
 
-    SDL_mutexV(mutex);
+    last.push_back((checksum >> 24) & 0xff);
+    last.push_back((checksum >> 16) & 0xff);
+    last.push_back((checksum >> 8)  & 0xff);
+    last.push_back(checksum & 0xff);
+
+    // one IDAT chunk per strip
+    for(int i = 0; i < strips.strip_count; i++) {
+        png_writer_append_chunk(output, "IDAT", &(strips.deflated[i][0]), strips.deflated[i].size());
+    }
+
+    png_writer_append_chunk(output, "IEND", 0, 0);
 }
 
-void PNGExporter::stop() {
-    if(!thread) return;
+// PNGExporter
+
+PNGExporter::PNGExporter(const std::string& filename, int worker_count) {
+
+    if(filename == "-") {
+        writer.setOutputStream(&std::cout);
+    } else {
+       this->filename = filename;
 
-    if(thread_state == PNG_EXPORTER_STOPPED || thread_state == PNG_EXPORTER_EXIT) return;
+       if(!writer.open(filename)) {
+            throw PNGExporterException(filename);
+        }
+    }
 
-    SDL_mutexP(mutex);
+    queue  = new FrameQueue(this, display.width * display.height * 3, worker_count);
+    reader = new PixelReader(GL_RGB, 3);
+}
 
-        thread_state = PNG_EXPORTER_EXIT;
+PNGExporter::~PNGExporter() {
 
-        SDL_CondSignal(cond);
+    stop();
 
-    SDL_mutexV(mutex);
+    delete reader;
+    delete queue;
 
-    SDL_WaitThread(thread, 0);
-    
-    thread = 0;
+    if(!filename.empty()) {
+        writer.close();
+    }
+}
+
+// write any frames still being read back or encoded.
+// requires the GL context to still be current
+void PNGExporter::stop() {
+    while(!reader->empty()) queueFrame();
+
+    queue->stop();
 }
 
 void PNGExporter::capture() {
 
-    std::vector<char>* next_pixel_ptr = (buffer_shared_ptr == &buffer1) ?
-        &buffer2 : &buffer1;
+    reader->readPixels();
+
+    // frames are passed on once the oldest read has had time to complete
+    if(reader->full()) queueFrame();
+}
+
+void PNGExporter::queueFrame() {
 
-    writer.capture(*next_pixel_ptr);
+    // waits if the encoders are too far behind
+    std::vector<char>& pixels = queue->beginFrame();
 
-    SDL_mutexP(mutex);
+    reader->getPixels(&(pixels[0]));
 
-        buffer_shared_ptr = next_pixel_ptr;
-        thread_state      = PNG_EXPORTER_WRITE;
+    queue->endFrame();
+}
+
+void PNGExporter::encodeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+    writer.encodePNG(pixels, output);
+}
 
-    SDL_CondSignal(cond);
-    SDL_mutexV(mutex);
+void PNGExporter::writeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+    writer.write(output);
 }
@@ -28,20 +28,41 @@
 #ifndef PNG_WRITER_H
 #define PNG_WRITER_H
 
-#include "SDL_thread.h"
+#include "frame_queue.h"
+#include "pixel_reader.h"
 
 #include <fstream>
 #include <vector>
 
+enum png_writer_filter { PNG_WRITER_FILTER_NONE, PNG_WRITER_FILTER_SUB, PNG_WRITER_FILTER_UP, PNG_WRITER_FILTER_AVERAGE, PNG_WRITER_FILTER_PAETH, PNG_WRITER_FILTER_ADAPTIVE };
+
 class PNGWriter {
 protected:
     std::ostream* out;
     size_t components;
 
+    int compression_level;
+    int compression_strategy;
+    int filter;
+    int thread_count;
+
     void init();
+
+    void encodeStrips(std::vector<char>& buffer, std::vector<char>& output);
 public:
     PNGWriter(int components = 3);
 
+    // zlib compression level (0-9) and strategy (eg Z_FILTERED, Z_RLE)
+    void setCompressionLevel(int level);
+    void setCompressionStrategy(int strategy);
+
+    // png_writer_filter applied to each row. adaptive picks the best filter per row
+    void setFilter(int filter);
+
+    // more than one thread splits the image into strips which are
+    // filtered and deflated in parallel then joined into one stream
+    void setThreads(int thread_count);
+
     bool open(const std::string& filename);
     void close();
 
@@ -50,36 +71,35 @@ public:
     void screenshot(const std::string& filename);
     void capture(std::vector<char>& buffer);
     void writePNG(std::vector<char>& buffer);
-};
 
-enum png_exporter_state { PNG_EXPORTER_WAIT, PNG_EXPORTER_WRITE, PNG_EXPORTER_EXIT, PNG_EXPORTER_STOPPED };
+    // encode to memory, so frames can be encoded on other threads
+    void encodePNG(std::vector<char>& buffer, std::vector<char>& output);
+    void write(const std::vector<char>& data);
+};
 
-class PNGExporter {
+class PNGExporter : public FrameEncoder {
 protected:
     PNGWriter writer;
 
-    std::vector<char>* buffer_shared_ptr;
-
-    std::vector<char> buffer1;
-    std::vector<char> buffer2;
-
-    SDL_cond*   cond;
-    SDL_mutex*  mutex;
-    SDL_Thread* thread;
-
-    int thread_state;
+    FrameQueue* queue;
+    PixelReader* reader;
 
     std::string filename;
 
-    static int startThread(void *exporter);
+    void queueFrame();
 public:
-    PNGExporter(const std::string& filename);
+    PNGExporter(const std::string& filename, int worker_count = 0);
     ~PNGExporter();
 
-    void run();
     void stop();
 
+    // settings are read by the encode workers, so only change them before capturing
+    PNGWriter& getWriter() { return writer; };
+
     void capture();
+
+    void encodeFrame(std::vector<char>& pixels, std::vector<char>& output);
+    void writeFrame(std::vector<char>& pixels, std::vector<char>& output);
 };
 
 class PNGExporterException : public std::exception {
@@ -22,21 +22,30 @@
 #ifdef _WIN32
     #include <io.h>
     #include <fcntl.h>
+    #include <sys/stat.h>
+#else
+    #include <unistd.h>
+    #include <fcntl.h>
 #endif
 
-extern "C" {
-static int dumper_thread(void *arg) {
-    FrameExporter *e = static_cast<FrameExporter *>(arg);
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
 
-    e->dumpThr();
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAW_VIDEO_SSSE3
+#include <tmmintrin.h>
+#endif
 
-    return 0;
-}
-};
+#if defined(RAW_VIDEO_SSSE3) && !defined(_MSC_VER)
+#define RAW_VIDEO_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define RAW_VIDEO_TARGET_SSSE3
+#endif
 
 // FrameExporter
 
-FrameExporter::FrameExporter() {
+FrameExporter::FrameExporter(int worker_count) {
 
     //this now assumes the display is setup
     //before the frame exporter is created
@@ -44,53 +53,35 @@ FrameExporter::FrameExporter() {
 
     rowstride     = display.width * 3;
 
-    pixels1        = new char[display.height * rowstride];
-    pixels2        = new char[display.height * rowstride];
-    pixels_out     = new char[display.height * rowstride];
-
-    pixels_shared_ptr = 0;
-
-    dumper_thread_state = FRAME_EXPORTER_WAIT;
-
-    cond   = SDL_CreateCond();
-    mutex  = SDL_CreateMutex();
-
-#if SDL_VERSION_ATLEAST(2,0,0)
-    thread = SDL_CreateThread( dumper_thread, "frame_exporter", this );
-#else
-    thread = SDL_CreateThread( dumper_thread, this );
-#endif
+    queue  = new FrameQueue(this, display.height * rowstride, worker_count);
+    reader = new PixelReader(GL_RGB, 3);
 }
 
 FrameExporter::~FrameExporter() {
     stop();
 
-    SDL_DestroyCond(cond);
-    SDL_DestroyMutex(mutex);
-
-    pixels_shared_ptr = 0;
-
-    delete[] pixels1;
-    delete[] pixels2;
-    delete[] pixels_out;
+    delete reader;
+    delete queue;
 }
 
+// write any frames still being read back or encoded. derived classes must
+// call this in their destructor as dumpImpl() is called for the remaining
+// frames. requires the GL context to still be current
+
 void FrameExporter::stop() {
-    if(!thread) return;
-    
-    if(dumper_thread_state == FRAME_EXPORTER_STOPPED || dumper_thread_state == FRAME_EXPORTER_EXIT) return;
+    while(!reader->empty()) queueFrame();
 
-    SDL_mutexP(mutex);
+    queue->stop();
+}
 
-        dumper_thread_state = FRAME_EXPORTER_EXIT;
+void FrameExporter::queueFrame() {
 
-        SDL_CondSignal(cond);
+    // waits if the encoders are too far behind
+    std::vector<char>& pixels = queue->beginFrame();
 
-    SDL_mutexV(mutex);
+    reader->getPixels(&(pixels[0]));
 
-    SDL_WaitThread(thread, 0);
-    
-    thread = 0;
+    queue->endFrame();
 }
 
 void FrameExporter::dump() {
@@ -100,60 +91,39 @@ void FrameExporter::dump() {
     glEnable(GL_TEXTURE_2D);
     glDisable(GL_BLEND);
 
-    char* next_pixel_ptr = (pixels_shared_ptr == pixels1) ? pixels2 : pixels1;
-
-    // copy pixels - now the right way up
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glReadPixels(0, 0, display.width, display.height,
-        GL_RGB, GL_UNSIGNED_BYTE, next_pixel_ptr);
+    // copy pixels, bottom row first
+    reader->readPixels();
 
-    // wait for lock before changing the pointer to point to our new buffer
-    SDL_mutexP(mutex);
-
-        //flip buffer we are pointing at
-        pixels_shared_ptr = next_pixel_ptr;
-        dumper_thread_state = FRAME_EXPORTER_DUMP;
-
-    SDL_CondSignal(cond);
-    SDL_mutexV(mutex);
+    // frames are passed on once the oldest read has had time to complete
+    if(reader->full()) queueFrame();
 }
 
-void FrameExporter::dumpThr() {
-
-    SDL_mutexP(mutex);
-
-    while(dumper_thread_state != FRAME_EXPORTER_EXIT) {
-
-        dumper_thread_state = FRAME_EXPORTER_WAIT;
+// frames need no encoding, the image is flipped as it is written
 
-        while (dumper_thread_state == FRAME_EXPORTER_WAIT) {
-            SDL_CondWait(cond, mutex);
-        }
+void FrameExporter::encodeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+}
 
-        if (dumper_thread_state == FRAME_EXPORTER_EXIT) break;
+void FrameExporter::writeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+    dumpImpl(&(pixels[0]));
+}
 
-        if (pixels_shared_ptr != 0) {
+void FrameExporter::dumpImpl(const char* pixels) {
+    dumpImpl();
+}
 
-            //invert image
-            for(int y=0;y<display.height;y++) {
-                for(int x=0;x<rowstride;x++) {
-                    pixels_out[x + y * rowstride] = pixels_shared_ptr[x + (display.height - y - 1) * rowstride];
-                }
-            }
+void FrameExporter::dumpImpl() {
+    static bool warned = false;
 
-            dumpImpl();
-        }
+    if(!warned) {
+        warnLog("FrameExporter does not implement dumpImpl(const char* pixels), frames are not being written");
+        warned = true;
     }
-
-    dumper_thread_state = FRAME_EXPORTER_STOPPED;
-
-    SDL_mutexV(mutex);
-
 }
 
 // PPMExporter
 
-PPMExporter::PPMExporter(std::string outputfile) {
+PPMExporter::PPMExporter(std::string outputfile, int worker_count)
+    : FrameExporter(worker_count) {
 
     if(outputfile == "-") {
 #ifdef _WIN32
@@ -182,7 +152,268 @@ PPMExporter::~PPMExporter() {
         ((std::fstream*)output)->close();
 }
 
-void PPMExporter::dumpImpl() {
+void PPMExporter::dumpImpl(const char* pixels) {
     *output << ppmheader;
-    output->write(pixels_out, rowstride * display.height);
+
+    //invert image
+    for(int y = display.height-1; y >= 0; y--) {
+        output->write(pixels + y * rowstride, rowstride);
+    }
+}
+
+// RawVideoExporter
+
+// BT.601 limited range, chroma is the average of each 2x2 block
+
+#define RAW_VIDEO_Y(r, g, b) (((66*(r) + 129*(g) + 25*(b) + 128) >> 8) + 16)
+#define RAW_VIDEO_U(r, g, b) (((-38*(r) - 74*(g) + 112*(b) + 128) >> 8) + 128)
+#define RAW_VIDEO_V(r, g, b) (((112*(r) - 94*(g) - 18*(b) + 128) >> 8) + 128)
+
+#ifdef RAW_VIDEO_SSSE3
+
+static int raw_video_has_ssse3() {
+#if SDL_VERSION_ATLEAST(2,0,0)
+    static int has_ssse3 = -1;
+
+    if(has_ssse3 == -1) has_ssse3 = SDL_HasSSSE3() ? 1 : 0;
+
+    return has_ssse3;
+#else
+    return 0;
+#endif
+}
+
+// split 16 rgb24 pixels into one register per channel
+
+RAW_VIDEO_TARGET_SSSE3
+static inline void raw_video_load_rgb16(const unsigned char* p, __m128i& r, __m128i& g, __m128i& b) {
+    __m128i a0 = _mm_loadu_si128((const __m128i*) p);
+    __m128i a1 = _mm_loadu_si128((const __m128i*) (p + 16));
+    __m128i a2 = _mm_loadu_si128((const __m128i*) (p + 32));
+
+    r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, _mm_setr_epi8( 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1)),
+                                  _mm_shuffle_epi8(a1, _mm_setr_epi8(-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14,-1,-1,-1,-1,-1))),
+                                  _mm_shuffle_epi8(a2, _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 1, 4, 7,10,13)));
+
+    g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, _mm_setr_epi8( 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1)),
+                                  _mm_shuffle_epi8(a1, _mm_setr_epi8(-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1))),
+                                  _mm_shuffle_epi8(a2, _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14)));
+
+    b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, _mm_setr_epi8( 2, 5, 8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1)),
+                                  _mm_shuffle_epi8(a1, _mm_setr_epi8(-1,-1,-1,-1,-1, 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1))),
+                                  _mm_shuffle_epi8(a2, _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15)));
+}
+
+RAW_VIDEO_TARGET_SSSE3
+static inline __m128i raw_video_luma8(__m128i r, __m128i g, __m128i b) {
+    // the weighted sum is at most 56228, so fits in unsigned 16 bits
+    __m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                                            _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+                              _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)),
+                                            _mm_set1_epi16(128)));
+
+    return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+RAW_VIDEO_TARGET_SSSE3
+static inline __m128i raw_video_luma16(__m128i r, __m128i g, __m128i b) {
+    __m128i zero = _mm_setzero_si128();
+
+    __m128i lo = raw_video_luma8(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = raw_video_luma8(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(b, zero));
+
+    return _mm_packus_epi16(lo, hi);
+}
+
+// converts blocks of 16x2 pixels, returns the number of columns converted
+
+RAW_VIDEO_TARGET_SSSE3
+static int raw_video_convert_rows_ssse3(const unsigned char* row0, const unsigned char* row1, int width,
+                                        unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v) {
+
+    __m128i ones = _mm_set1_epi8(1);
+    __m128i two  = _mm_set1_epi16(2);
+    __m128i half = _mm_set1_epi16(128);
+
+    int x = 0;
+
+    for(; x + 16 <= width; x += 16) {
+        __m128i r0, g0, b0, r1, g1, b1;
+
+        raw_video_load_rgb16(row0 + x*3, r0, g0, b0);
+        raw_video_load_rgb16(row1 + x*3, r1, g1, b1);
+
+        _mm_storeu_si128((__m128i*) (y0 + x), raw_video_luma16(r0, g0, b0));
+        _mm_storeu_si128((__m128i*) (y1 + x), raw_video_luma16(r1, g1, b1));
+
+        // sum horizontal pairs of both rows
+        __m128i r = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_maddubs_epi16(r0, ones), _mm_maddubs_epi16(r1, ones)), two), 2);
+        __m128i g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_maddubs_epi16(g0, ones), _mm_maddubs_epi16(g1, ones)), two), 2);
+        __m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_maddubs_epi16(b0, ones), _mm_maddubs_epi16(b1, ones)), two), 2);
+
+        __m128i cu = _mm_sub_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)),
+                                   _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(38)), _mm_mullo_epi16(g, _mm_set1_epi16(74))));
+
+        __m128i cv = _mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)),
+                                   _mm_add_epi16(_mm_mullo_epi16(g, _mm_set1_epi16(94)), _mm_mullo_epi16(b, _mm_set1_epi16(18))));
+
+        cu = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(cu, half), 8), half);
+        cv = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(cv, half), 8), half);
+
+        _mm_storel_epi64((__m128i*) (u + x/2), _mm_packus_epi16(cu, cu));
+        _mm_storel_epi64((__m128i*) (v + x/2), _mm_packus_epi16(cv, cv));
+    }
+
+    return x;
+}
+
+#endif
+
+// converts bottom-up rgb24 rows to top-down YUV 4:2:0 planes
+
+static void raw_video_rgb24_to_yuv420(const unsigned char* pixels, int width, int height, size_t rowstride,
+                                      unsigned char* y_plane, unsigned char* u_plane, unsigned char* v_plane) {
+
+    int chroma_width = (width + 1) / 2;
+
+    for(int y = 0; y < height; y += 2) {
+
+        // the last row is repeated if the height is odd
+        const unsigned char* row0 = pixels + (height - 1 - y) * rowstride;
+        const unsigned char* row1 = y + 1 < height ? row0 - rowstride : row0;
+
+        unsigned char* y0 = y_plane + y * width;
+        unsigned char* y1 = y + 1 < height ? y0 + width : y0;
+
+        unsigned char* u = u_plane + (y/2) * chroma_width;
+        unsigned char* v = v_plane + (y/2) * chroma_width;
+
+        int x = 0;
+
+#ifdef RAW_VIDEO_SSSE3
+        if(raw_video_has_ssse3()) x = raw_video_convert_rows_ssse3(row0, row1, width, y0, y1, u, v);
+#endif
+
+        for(int i = x; i < width; i++) {
+            const unsigned char* p0 = row0 + i*3;
+            const unsigned char* p1 = row1 + i*3;
+
+            y0[i] = RAW_VIDEO_Y(p0[0], p0[1], p0[2]);
+            y1[i] = RAW_VIDEO_Y(p1[0], p1[1], p1[2]);
+        }
+
+        for(int i = x/2; i < chroma_width; i++) {
+
+            // the last column is repeated if the width is odd
+            int a = i*6;
+            int b = i*2 + 1 < width ? a + 3 : a;
+
+            int r = (row0[a]   + row0[b]   + row1[a]   + row1[b]   + 2) >> 2;
+            int g = (row0[a+1] + row0[b+1] + row1[a+1] + row1[b+1] + 2) >> 2;
+            int bl= (row0[a+2] + row0[b+2] + row1[a+2] + row1[b+2] + 2) >> 2;
+
+            u[i] = RAW_VIDEO_U(r, g, bl);
+            v[i] = RAW_VIDEO_V(r, g, bl);
+        }
+    }
+}
+
+RawVideoExporter::RawVideoExporter(const std::string& outputfile, int format, int frame_rate, int worker_count)
+    : FrameExporter(worker_count), format(format) {
+
+    write_failed = false;
+
+    if(outputfile == "-") {
+#ifdef _WIN32
+        _setmode( _fileno( stdout ), _O_BINARY );
+        fd = _fileno( stdout );
+#else
+        fd = STDOUT_FILENO;
+#endif
+    } else {
+        filename = outputfile;
+
+#ifdef _WIN32
+        fd = _open(outputfile.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd = open(outputfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if(fd == -1) {
+            throw PPMExporterException(filename);
+        }
+    }
+
+    if(format == RAW_VIDEO_Y4M) {
+        char header[256];
+
+        int header_length = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", display.width, display.height, frame_rate);
+
+        writeData(header, header_length);
+    }
+}
+
+RawVideoExporter::~RawVideoExporter() {
+    stop();
+
+    if(!filename.empty()) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+}
+
+// each frame is converted into one buffer so it can be sent with a single write
+
+void RawVideoExporter::encodeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+
+    const unsigned char* src = (const unsigned char*) &(pixels[0]);
+
+    if(format == RAW_VIDEO_RGB24) {
+        output.resize(display.height * rowstride);
+
+        for(int y = 0; y < display.height; y++) {
+            memcpy(&(output[y * rowstride]), src + (display.height - 1 - y) * rowstride, rowstride);
+        }
+
+        return;
+    }
+
+    const char frame_header[] = "FRAME\n";
+    size_t header_length = sizeof(frame_header) - 1;
+
+    size_t luma_size   = display.width * display.height;
+    size_t chroma_size = ((display.width + 1) / 2) * ((display.height + 1) / 2);
+
+    output.resize(header_length + luma_size + chroma_size * 2);
+
+    memcpy(&(output[0]), frame_header, header_length);
+
+    unsigned char* y_plane = (unsigned char*) &(output[header_length]);
+
+    raw_video_rgb24_to_yuv420(src, display.width, display.height, rowstride, y_plane, y_plane + luma_size, y_plane + luma_size + chroma_size);
+}
+
+void RawVideoExporter::writeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+    writeData(&(output[0]), output.size());
+}
+
+void RawVideoExporter::writeData(const char* data, size_t size) {
+
+    while(size > 0 && !write_failed) {
+#ifdef _WIN32
+        int written = _write(fd, data, (unsigned int) std::min(size, (size_t) 1073741824));
+#else
+        ssize_t written = write(fd, data, size);
+#endif
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            write_failed = true;
+            break;
+        }
+
+        data += written;
+        size -= written;
+    }
 }
@@ -26,37 +26,35 @@
 
 #include "SDL.h"
 #include "gl.h"
+#include "frame_queue.h"
+#include "pixel_reader.h"
 
-enum { FRAME_EXPORTER_WAIT,
-       FRAME_EXPORTER_DUMP,
-       FRAME_EXPORTER_EXIT,
-       FRAME_EXPORTER_STOPPED };
-
-class FrameExporter {
+class FrameExporter : public FrameEncoder {
 protected:
 
-    char* pixels1;
-    char* pixels2;
-    char* pixels_out;
-
-    char* pixels_shared_ptr;
-
     size_t rowstride;
 
     GLuint screentex;
 
-    SDL_Thread* thread;
-    SDL_mutex* mutex;
-    SDL_cond* cond;
-    int dumper_thread_state;
+    FrameQueue* queue;
+    PixelReader* reader;
 
+    void queueFrame();
 public:
-    FrameExporter();
+    FrameExporter(int worker_count = 1);
     virtual ~FrameExporter();
     void stop();
     void dump();
-    void dumpThr();
-    virtual void dumpImpl() {};
+
+    // pixels are rows of rowstride bytes, bottom row first as read from GL
+    virtual void dumpImpl(const char* pixels);
+
+    // replaced by dumpImpl(const char* pixels), which calls this by default
+    // so older subclasses still receive frames. warns if neither is overridden
+    virtual void dumpImpl();
+
+    void encodeFrame(std::vector<char>& pixels, std::vector<char>& output);
+    void writeFrame(std::vector<char>& pixels, std::vector<char>& output);
 };
 
 class PPMExporterException : public std::exception {
@@ -76,10 +74,30 @@ protected:
     char ppmheader[1024];
 
 public:
-    PPMExporter(std::string outputfile);
+    PPMExporter(std::string outputfile, int worker_count = 1);
     virtual ~PPMExporter();
-    virtual void dumpImpl();
+    virtual void dumpImpl(const char* pixels);
 };
 
+// uncompressed video for piping to an encoder, either YUV4MPEG2 with the
+// frames converted to 4:2:0 or raw rgb24 frames with no header
+
+enum raw_video_format { RAW_VIDEO_Y4M, RAW_VIDEO_RGB24 };
+
+class RawVideoExporter : public FrameExporter {
+protected:
+    int fd;
+    std::string filename;
+    int format;
+    bool write_failed;
+
+    void writeData(const char* data, size_t size);
+public:
+    RawVideoExporter(const std::string& outputfile, int format = RAW_VIDEO_Y4M, int frame_rate = 60, int worker_count = 0);
+    virtual ~RawVideoExporter();
+
+    void encodeFrame(std::vector<char>& pixels, std::vector<char>& output);
+    void writeFrame(std::vector<char>& pixels, std::vector<char>& output);
+};
 
 #endif
@@ -27,6 +27,43 @@
 
 #include "quadtree.h"
 
+#include "SDL_thread.h"
+
+#include <algorithm>
+#include <queue>
+
+// item sorted by the morton code of the smallest cell of the tree it fits
+// inside, followed by the level of that cell (the root is level 0)
+
+class QuadBuildItem {
+public:
+    unsigned int code;
+    int level;
+    QuadItem* item;
+};
+
+// subtree built in parallel by QuadTree::build()
+
+class QuadBuildJob {
+public:
+    QuadNode* node;
+    QuadBuildItem* begin;
+    QuadBuildItem* end;
+    std::vector<QuadItem*> straddling;
+    unsigned int code;
+    int nodes_added;
+    int items_added;
+
+    QuadBuildJob(QuadNode* node, QuadBuildItem* begin, QuadBuildItem* end, unsigned int code)
+        : node(node), begin(begin), end(end), code(code), nodes_added(0), items_added(0) {};
+};
+
+#define QUADTREE_BUILD_LEVELS 16
+
+static bool quadtree_build_code_less(const QuadBuildItem& a, unsigned int code) {
+    return a.code < code;
+}
+
 // QUAD NODE
 
 // allow more items in node if
@@ -54,6 +91,23 @@ void QuadNode::addItem(QuadItem* item) {
         return;
     }
 
+    split();
+
+    for(std::list<QuadItem*>::iterator it = items.begin(); it != items.end(); it++) {
+        QuadItem* oi = *it;
+        tree->item_count--;
+        oi->node_count--;
+        addToChild(oi);
+    }
+
+    items.clear();
+
+    addToChild(item);
+}
+
+
+void QuadNode::split(bool count_nodes) {
+
     vec2 average = bounds.centre();
 
     vec2 middle = average - bounds.min;
@@ -66,32 +120,210 @@ void QuadNode::addItem(QuadItem* item) {
 
     //top left
     newbounds = Bounds2D( bounds.min + vec2(0.0, 0.0), bounds.min + middle );
-    children.push_back(new QuadNode(tree, this, newbounds, depth));
+    children.push_back(new QuadNode(tree, this, newbounds, depth, count_nodes));
 
     //top right
     newbounds = Bounds2D( bounds.min + vec2(middle.x, 0.0), bounds.min + vec2(relmax.x,middle.y) );
-    children.push_back(new QuadNode(tree, this, newbounds, depth));
+    children.push_back(new QuadNode(tree, this, newbounds, depth, count_nodes));
 
     //bottom left
     newbounds = Bounds2D( bounds.min + vec2(0.0, middle.y), bounds.min + vec2(middle.x,relmax.y) );
-    children.push_back(new QuadNode(tree, this, newbounds, depth));
+    children.push_back(new QuadNode(tree, this, newbounds, depth, count_nodes));
 
     //bottom right
     newbounds = Bounds2D( bounds.min + middle, bounds.max );
-    children.push_back(new QuadNode(tree, this, newbounds, depth));
+    children.push_back(new QuadNode(tree, this, newbounds, depth, count_nodes));
+}
+
+// build the subtree from a list of items in one pass, splitting under the
+// same rules as addItem would if they were added one at a time.
+//
+// begin to end are the sorted items that fit inside a single cell below this
+// node. as they are in morton order, those fitting inside a child are found
+// by a binary search. items that overlap more than one child (straddling)
+// are tested against the bounds of each child instead
+
+void QuadNode::build(QuadBuildItem* begin, QuadBuildItem* end, std::vector<QuadItem*>& straddling, unsigned int code, int& nodes_added, int& items_added) {
+
+    int level = depth - 1;
+
+    // items that fit no smaller cell than this node come first
+    for(; begin != end && begin->level == level; begin++) {
+        straddling.push_back(begin->item);
+    }
+
+    size_t item_count = (end - begin) + straddling.size();
+
+    if(depth >= tree->max_node_depth || item_count <= tree->max_node_items) {
+        for(QuadBuildItem* it = begin; it != end; it++) {
+            items.push_back(it->item);
+        }
+        items.insert(items.end(), straddling.begin(), straddling.end());
+        items_added += item_count;
+        return;
+    }
+
+    split(false);
+    nodes_added += 4;
+
+    std::vector<QuadItem*> child_straddling;
+
+    QuadBuildItem* child_begin = begin;
+
+    for(int i=0;i<4;i++) {
+        QuadBuildItem* child_end = end;
+        unsigned int child_code  = code;
+
+        // the range is empty below the deepest level of the codes
+        if(level < QUADTREE_BUILD_LEVELS) {
+            int shift = 2 * (QUADTREE_BUILD_LEVELS - 1 - level);
+
+            child_code = code | ((unsigned int) i << shift);
+
+            if(i < 3) child_end = std::lower_bound(child_begin, end, code | ((unsigned int) (i+1) << shift), quadtree_build_code_less);
+        }
+
+        child_straddling.clear();
+
+        for(std::vector<QuadItem*>::iterator it = straddling.begin(); it != straddling.end(); it++) {
+            if(children[i]->bounds.overlaps((*it)->quadItemBounds)) child_straddling.push_back(*it);
+        }
+
+        children[i]->build(child_begin, child_end, child_straddling, child_code, nodes_added, items_added);
+
+        child_begin = child_end;
+    }
+}
+
+// split nodes until each holds few enough items to be built as a separate job
+
+void QuadNode::buildJobs(QuadBuildItem* begin, QuadBuildItem* end, std::vector<QuadItem*>& straddling, unsigned int code, size_t job_items, std::vector<QuadBuildJob*>& jobs, int& nodes_added) {
+
+    int level = depth - 1;
+
+    for(; begin != end && begin->level == level; begin++) {
+        straddling.push_back(begin->item);
+    }
+
+    size_t item_count = (end - begin) + straddling.size();
+
+    if(depth >= tree->max_node_depth || item_count <= tree->max_node_items || item_count <= job_items) {
+        QuadBuildJob* job = new QuadBuildJob(this, begin, end, code);
+        job->straddling.swap(straddling);
+        jobs.push_back(job);
+        return;
+    }
+
+    split(false);
+    nodes_added += 4;
+
+    QuadBuildItem* child_begin = begin;
+
+    for(int i=0;i<4;i++) {
+        QuadBuildItem* child_end = end;
+        unsigned int child_code  = code;
+
+        if(level < QUADTREE_BUILD_LEVELS) {
+            int shift = 2 * (QUADTREE_BUILD_LEVELS - 1 - level);
+
+            child_code = code | ((unsigned int) i << shift);
+
+            if(i < 3) child_end = std::lower_bound(child_begin, end, code | ((unsigned int) (i+1) << shift), quadtree_build_code_less);
+        }
+
+        std::vector<QuadItem*> child_straddling;
+
+        for(std::vector<QuadItem*>::iterator it = straddling.begin(); it != straddling.end(); it++) {
+            if(children[i]->bounds.overlaps((*it)->quadItemBounds)) child_straddling.push_back(*it);
+        }
+
+        children[i]->buildJobs(child_begin, child_end, child_straddling, child_code, job_items, jobs, nodes_added);
+
+        child_begin = child_end;
+    }
+}
+
+void QuadNode::countItems() {
 
     for(std::list<QuadItem*>::iterator it = items.begin(); it != items.end(); it++) {
-        QuadItem* oi = *it;
-        tree->item_count--;
-        oi->node_count--;
-        addToChild(oi);
+        (*it)->node_count++;
     }
 
-    items.clear();
+    if(children.empty()) return;
 
-    addToChild(item);
+    for(int i=0;i<4;i++) {
+        children[i]->countItems();
+    }
 }
 
+// remove the item from any leaves it was added to. only nodes overlapping
+// the item bounds are searched unless use_bounds is false.
+
+bool QuadNode::removeItem(QuadItem* item, bool use_bounds) {
+
+    if(children.empty()) {
+        for(std::list<QuadItem*>::iterator it = items.begin(); it != items.end(); it++) {
+            if(*it == item) {
+                items.erase(it);
+                tree->item_count--;
+                item->node_count--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool removed = false;
+
+    for(int i=0;i<4;i++) {
+        if(!use_bounds || children[i]->bounds.overlaps(item->quadItemBounds)) {
+            if(children[i]->removeItem(item, use_bounds)) removed = true;
+        }
+    }
+
+    if(removed) collapse();
+
+    return removed;
+}
+
+// merge the children back into this node if they are all leaves
+// and hold fewer unique items than the node capacity
+
+void QuadNode::collapse() {
+
+    if(children.empty()) return;
+
+    std::vector<QuadItem*> unique_items;
+
+    for(int i=0;i<4;i++) {
+        if(!children[i]->children.empty()) return;
+
+        for(std::list<QuadItem*>::iterator it = children[i]->items.begin(); it != children[i]->items.end(); it++) {
+            QuadItem* oi = *it;
+
+            if(std::find(unique_items.begin(), unique_items.end(), oi) == unique_items.end()) {
+                if(unique_items.size() + 1 >= tree->max_node_items) return;
+
+                unique_items.push_back(oi);
+            }
+        }
+    }
+
+    for(int i=0;i<4;i++) {
+        for(std::list<QuadItem*>::iterator it = children[i]->items.begin(); it != children[i]->items.end(); it++) {
+            (*it)->node_count--;
+        }
+        delete children[i];
+    }
+
+    children.clear();
+
+    for(std::vector<QuadItem*>::iterator it = unique_items.begin(); it != unique_items.end(); it++) {
+        tree->item_count++;
+        (*it)->node_count++;
+        items.push_back(*it);
+    }
+}
 
 void QuadNode::addToChild(QuadItem* item) {
     if(children.empty()) return;
@@ -208,7 +440,9 @@ int QuadNode::getItemsAt(std::set<QuadItem*>& itemset, vec2 pos) {
     return children[index]->getItemsAt(itemset, pos);
 }
 
-void QuadNode::visitLeavesInFrustum(const Frustum& frustum, VisitFunctor<QuadNode> & visit){
+// children fully inside the frustum are visited without further tests
+
+void QuadNode::visitLeavesInFrustum(const Frustum& frustum, VisitFunctor<QuadNode> & visit, unsigned int plane_mask){
 
     if(!items.empty()) {
 
@@ -217,16 +451,29 @@ void QuadNode::visitLeavesInFrustum(const Frustum& frustum, VisitFunctor<QuadNod
     }else if(!children.empty()){
 
       //visit each corner
-      for(int i=0;i<4;i++)
-        if(!children[i]->empty() && frustum.intersects(children[i]->bounds))
-            children[i]->visitLeavesInFrustum(frustum, visit);
+      for(int i=0;i<4;i++) {
+        if(children[i]->empty()) continue;
+
+        unsigned int child_mask = plane_mask;
+
+        switch(frustum.classify(children[i]->bounds, child_mask)) {
+            case FRUSTUM_INSIDE:
+                children[i]->visitLeaves(visit);
+                break;
+            case FRUSTUM_INTERSECTS:
+                children[i]->visitLeavesInFrustum(frustum, visit, child_mask);
+                break;
+            default:
+                break;
+        }
+      }
 
     }
 
 }
 
 
-void QuadNode::visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadItem> & visit){
+void QuadNode::visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadItem> & visit, unsigned int plane_mask){
 
     if(!items.empty()) {
 
@@ -236,9 +483,57 @@ void QuadNode::visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadIte
     }else if(!children.empty()){
 
         //visit each corner
+        for(int i=0;i<4;i++) {
+          if(children[i]->empty()) continue;
+
+          unsigned int child_mask = plane_mask;
+
+          switch(frustum.classify(children[i]->bounds, child_mask)) {
+              case FRUSTUM_INSIDE:
+                  children[i]->visitItems(visit);
+                  break;
+              case FRUSTUM_INTERSECTS:
+                  children[i]->visitItemsInFrustum(frustum, visit, child_mask);
+                  break;
+              default:
+                  break;
+          }
+        }
+
+    }
+
+}
+
+
+void QuadNode::visitLeaves(VisitFunctor<QuadNode> & visit){
+
+    if(!items.empty()) {
+
+        visit(this);
+
+    }else if(!children.empty()){
+
+      for(int i=0;i<4;i++)
+        if(!children[i]->empty())
+            children[i]->visitLeaves(visit);
+
+    }
+
+}
+
+
+void QuadNode::visitItems(VisitFunctor<QuadItem> & visit){
+
+    if(!items.empty()) {
+
+        for(std::list<QuadItem*>::const_iterator it = items.begin(); it != items.end(); it++)
+            visit(*it);
+
+    }else if(!children.empty()){
+
         for(int i=0;i<4;i++)
-          if(!children[i]->empty() && frustum.intersects(children[i]->bounds))
-            children[i]->visitItemsInFrustum(frustum, visit);
+          if(!children[i]->empty())
+            children[i]->visitItems(visit);
 
     }
 
@@ -279,6 +574,110 @@ void QuadNode::visitItemsAt(const vec2 & pos, VisitFunctor<QuadItem> & visit){
 
 }
 
+// best-first search over nodes and items ordered by distance
+
+class QuadSearchEntry {
+public:
+    float distance;
+    QuadNode* node;
+    QuadItem* item;
+
+    QuadSearchEntry(float distance, QuadNode* node, QuadItem* item) : distance(distance), node(node), item(item) {};
+
+    bool operator<(const QuadSearchEntry& other) const {
+        return distance > other.distance;
+    }
+};
+
+// items are stamped as they are queued, using the stamp shared by all
+// trees so a stamp left on an item by an earlier tree cannot match
+
+int QuadNode::nearest(const vec2& pos, int k, VisitFunctor<QuadItem> & visit) {
+
+    unsigned int stamp = QuadTree::nextQueryStamp();
+
+    std::priority_queue<QuadSearchEntry> queue;
+
+    queue.push(QuadSearchEntry(bounds.distance2(pos), this, 0));
+
+    int visited = 0;
+
+    while(visited < k && !queue.empty()) {
+        QuadSearchEntry entry = queue.top();
+        queue.pop();
+
+        // no unvisited item can be closer than this one
+        if(entry.item != 0) {
+            visit(entry.item);
+            visited++;
+            continue;
+        }
+
+        QuadNode* node = entry.node;
+
+        for(std::list<QuadItem*>::iterator it = node->items.begin(); it != node->items.end(); it++) {
+            QuadItem* oi = *it;
+
+            if(oi->quad_query_stamp == stamp) continue;
+            oi->quad_query_stamp = stamp;
+
+            queue.push(QuadSearchEntry(oi->quadItemBounds.distance2(pos), 0, oi));
+        }
+
+        if(node->children.empty()) continue;
+
+        for(int i=0;i<4;i++) {
+            QuadNode* c = node->children[i];
+            if(!c->empty()) queue.push(QuadSearchEntry(c->bounds.distance2(pos), c, 0));
+        }
+    }
+
+    return visited;
+}
+
+QuadItem* QuadNode::raycast(const vec2& origin, const vec2& dir, float* distance) {
+
+    unsigned int stamp = QuadTree::nextQueryStamp();
+
+    std::priority_queue<QuadSearchEntry> queue;
+
+    float hit;
+
+    if(!bounds.intersects(origin, dir, hit)) return 0;
+
+    queue.push(QuadSearchEntry(hit, this, 0));
+
+    while(!queue.empty()) {
+        QuadSearchEntry entry = queue.top();
+        queue.pop();
+
+        if(entry.item != 0) {
+            if(distance != 0) *distance = entry.distance;
+            return entry.item;
+        }
+
+        QuadNode* node = entry.node;
+
+        for(std::list<QuadItem*>::iterator it = node->items.begin(); it != node->items.end(); it++) {
+            QuadItem* oi = *it;
+
+            if(oi->quad_query_stamp == stamp) continue;
+            oi->quad_query_stamp = stamp;
+
+            if(oi->quadItemBounds.intersects(origin, dir, hit)) queue.push(QuadSearchEntry(hit, 0, oi));
+        }
+
+        if(node->children.empty()) continue;
+
+        for(int i=0;i<4;i++) {
+            QuadNode* c = node->children[i];
+            if(!c->empty() && c->bounds.intersects(origin, dir, hit)) queue.push(QuadSearchEntry(hit, c, 0));
+        }
+    }
+
+    return 0;
+}
+
 bool QuadNode::empty() {
     return (items.empty() && children.empty());
 }
@@ -299,7 +698,7 @@ int QuadNode::getChildIndex(const vec2 & pos) const{
 
 
 
-QuadNode::QuadNode(QuadTree* tree, QuadNode* parent, Bounds2D bounds, int parent_depth) {
+QuadNode::QuadNode(QuadTree* tree, QuadNode* parent, Bounds2D bounds, int parent_depth, bool count_node) {
 
     this->parent = parent;
     this->tree   = tree;
@@ -308,7 +707,7 @@ QuadNode::QuadNode(QuadTree* tree, QuadNode* parent, Bounds2D bounds, int parent
 
     listid = 0;
 
-    tree->node_count++;
+    if(count_node) tree->node_count++;
 }
 
 
@@ -343,7 +742,7 @@ int QuadNode::usedChildren() {
 }
 
 
-int QuadNode::draw(Frustum& frustum) {
+int QuadNode::draw(Frustum& frustum, unsigned int plane_mask) {
 
     if(listid && !items.empty()) {
         glPushMatrix();
@@ -357,8 +756,13 @@ int QuadNode::draw(Frustum& frustum) {
     if(!children.empty()) {
         for(int i=0;i<4;i++) {
             QuadNode* c = children[i];
-            if(!c->empty() && frustum.intersects(c->bounds)) {
-                drawn += c->draw(frustum);
+            if(c->empty()) continue;
+
+            // once inside every plane the mask is empty and no more tests are done
+            unsigned int child_mask = plane_mask;
+
+            if(frustum.classify(c->bounds, child_mask) != FRUSTUM_OUTSIDE) {
+                drawn += c->draw(frustum, child_mask);
             }
         }
     }
@@ -440,6 +844,8 @@ QuadTree::QuadTree(Bounds2D bounds, int max_node_depth, int max_node_items) {
     node_count        = 0;
     unique_item_count = 0;
 
+    this->bounds = bounds;
+
     this->max_node_depth = max_node_depth;
     this->max_node_items = max_node_items;
 
@@ -468,6 +874,105 @@ int QuadTree::getItemsInBounds(std::set<QuadItem*>& itemset, Bounds2D& bounds) c
 }
 
 
+// items straddling multiple leaves are only returned once, by marking
+// them with a stamp unique to the query instead of inserting into a set.
+// the stamp is unique across all trees, so an item moved to a new tree
+// or added to several trees cannot match a stamp it kept from another
+
+unsigned int QuadTree::query_stamp = 0;
+
+unsigned int QuadTree::nextQueryStamp() {
+    query_stamp++;
+
+    if(query_stamp == 0) query_stamp = 1;
+
+    return query_stamp;
+}
+
+class QuadItemCollector : public VisitFunctor<QuadItem> {
+    std::vector<QuadItem*>& items;
+    unsigned int stamp;
+protected:
+    virtual bool test(QuadItem* item) { return true; };
+public:
+    int count;
+
+    QuadItemCollector(std::vector<QuadItem*>& items, unsigned int stamp) : items(items), stamp(stamp), count(0) {};
+
+    void operator()(QuadItem* item) {
+        if(item->quad_query_stamp == stamp) return;
+        item->quad_query_stamp = stamp;
+
+        if(!test(item)) return;
+
+        items.push_back(item);
+        count++;
+    }
+};
+
+class QuadItemAtCollector : public QuadItemCollector {
+    const vec2& pos;
+protected:
+    bool test(QuadItem* item) { return item->quadItemBounds.contains(pos); };
+public:
+    QuadItemAtCollector(std::vector<QuadItem*>& items, unsigned int stamp, const vec2& pos) : QuadItemCollector(items, stamp), pos(pos) {};
+};
+
+class QuadItemInFrustumCollector : public QuadItemCollector {
+    const Frustum& frustum;
+protected:
+    bool test(QuadItem* item) { return frustum.intersects(item->quadItemBounds); };
+public:
+    QuadItemInFrustumCollector(std::vector<QuadItem*>& items, unsigned int stamp, const Frustum& frustum) : QuadItemCollector(items, stamp), frustum(frustum) {};
+};
+
+class QuadItemInBoundsCollector : public QuadItemCollector {
+    const Bounds2D& bounds;
+protected:
+    bool test(QuadItem* item) { return bounds.overlaps(item->quadItemBounds); };
+public:
+    QuadItemInBoundsCollector(std::vector<QuadItem*>& items, unsigned int stamp, const Bounds2D& bounds) : QuadItemCollector(items, stamp), bounds(bounds) {};
+};
+
+int QuadTree::getItemsAt(std::vector<QuadItem*>& items, const vec2& pos, bool test_item_bounds) {
+
+    if(test_item_bounds) {
+        QuadItemAtCollector collector(items, nextQueryStamp(), pos);
+        root->visitItemsAt(pos, collector);
+        return collector.count;
+    }
+
+    QuadItemCollector collector(items, nextQueryStamp());
+    root->visitItemsAt(pos, collector);
+    return collector.count;
+}
+
+int QuadTree::getItemsInFrustum(std::vector<QuadItem*>& items, const Frustum& frustum, bool test_item_bounds) {
+
+    if(test_item_bounds) {
+        QuadItemInFrustumCollector collector(items, nextQueryStamp(), frustum);
+        root->visitItemsInFrustum(frustum, collector);
+        return collector.count;
+    }
+
+    QuadItemCollector collector(items, nextQueryStamp());
+    root->visitItemsInFrustum(frustum, collector);
+    return collector.count;
+}
+
+int QuadTree::getItemsInBounds(std::vector<QuadItem*>& items, const Bounds2D& bounds, bool test_item_bounds) {
+
+    if(test_item_bounds) {
+        QuadItemInBoundsCollector collector(items, nextQueryStamp(), bounds);
+        root->visitItemsInBounds(bounds, collector);
+        return collector.count;
+    }
+
+    QuadItemCollector collector(items, nextQueryStamp());
+    root->visitItemsInBounds(bounds, collector);
+    return collector.count;
+}
+
 void QuadTree::getLeavesInFrustum(std::set<QuadNode*>& nodeset, Frustum& frustum) {
     return root->getLeavesInFrustum(nodeset, frustum);
 }
@@ -493,6 +998,18 @@ void QuadTree::visitLeavesInFrustum(const Frustum& frustum, VisitFunctor<QuadNod
 }
 
 
+int QuadTree::nearest(const vec2& pos, int k, VisitFunctor<QuadItem> & visit) {
+    if(k <= 0) return 0;
+
+    return root->nearest(pos, k, visit);
+}
+
+
+QuadItem* QuadTree::raycast(const vec2& origin, const vec2& dir, float* distance) {
+    return root->raycast(origin, dir, distance);
+}
+
+
 void QuadTree::addItem(QuadItem* item) {
     item->node_count = 0;
     root->addItem(item);
@@ -500,6 +1017,228 @@ void QuadTree::addItem(QuadItem* item) {
 }
 
 
+// returns false if the item was not in the tree
+bool QuadTree::removeItem(QuadItem* item) {
+
+    bool removed = root->removeItem(item);
+
+    // bounds changed since the item was added, search the whole tree
+    if(item->node_count > 0 && root->removeItem(item, false)) removed = true;
+
+    if(removed) unique_item_count--;
+
+    return removed;
+}
+
+// move an item to the nodes matching its updated bounds.
+// note: display lists need to be regenerated after the tree changes
+
+void QuadTree::updateItem(QuadItem* item) {
+    removeItem(item);
+
+    item->updateQuadItemBounds();
+
+    addItem(item);
+}
+
+// Bulk Build
+
+#define QUADTREE_PARALLEL_BUILD_MIN_ITEMS 16384
+
+class QuadBuildQueue {
+public:
+    std::vector<QuadBuildJob*> jobs;
+
+    SDL_mutex* mutex;
+    int next_job;
+
+    QuadBuildQueue() : next_job(0) {
+        mutex = SDL_CreateMutex();
+    };
+
+    ~QuadBuildQueue() {
+        SDL_DestroyMutex(mutex);
+    };
+
+    int nextJob() {
+        SDL_mutexP(mutex);
+
+            int i = next_job++;
+
+        SDL_mutexV(mutex);
+
+        return i;
+    };
+};
+
+static int quadtree_build_thread(void* arg) {
+    QuadBuildQueue* queue = static_cast<QuadBuildQueue*>(arg);
+
+    int job_count = (int) queue->jobs.size();
+
+    int i;
+    while((i = queue->nextJob()) < job_count) {
+        QuadBuildJob* job = queue->jobs[i];
+        job->node->build(job->begin, job->end, job->straddling, job->code, job->nodes_added, job->items_added);
+    }
+
+    return 0;
+}
+
+// interleave the bits of the cell coordinates so the ordering matches
+// the order of the children of a node (y is the high bit)
+
+static unsigned int quadtree_spread_bits(unsigned int v) {
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// position of v within the bounds in cells at the deepest level, or
+// outside of 0 to 65535 when not within the bounds
+
+static int quadtree_cell_coord(float v, float min, float size) {
+    if(!(size > 0.0f)) return -1;
+
+    float t = (v - min) / size * (float) (1 << QUADTREE_BUILD_LEVELS);
+
+    if(!(t >= 0.0f)) return -1;
+    if(t >= (float) (1 << QUADTREE_BUILD_LEVELS)) return 1 << QUADTREE_BUILD_LEVELS;
+
+    return (int) t;
+}
+
+// number of levels the range min to max stays within a single cell for.
+// the range is widened by a couple of cells so that rounding can never
+// place an item touching the edge of a node entirely inside one child
+
+static int quadtree_cell_levels(int& min, int& max) {
+    min -= 2;
+    max += 2;
+
+    if(min < 0 || max >= (1 << QUADTREE_BUILD_LEVELS)) return 0;
+
+    int levels = 0;
+
+    unsigned int diff = (unsigned int) (min ^ max);
+
+    while(levels < QUADTREE_BUILD_LEVELS && !(diff & (1 << (QUADTREE_BUILD_LEVELS - 1 - levels)))) levels++;
+
+    return levels;
+}
+
+static bool quadtree_build_item_compare(const QuadBuildItem& a, const QuadBuildItem& b) {
+    if(a.code != b.code) return a.code < b.code;
+
+    return a.level < b.level;
+}
+
+// replace the contents of the tree with the items. items are sorted in
+// morton order so the subtree under each node is built from a contiguous
+// range of items, then the tree is split into subtrees which are built
+// across a pool of threads
+
+void QuadTree::build(std::vector<QuadItem*>& items, int thread_count) {
+
+    delete root;
+
+    item_count        = 0;
+    node_count        = 0;
+    unique_item_count = items.size();
+
+    root = new QuadNode(this, 0, bounds, 0);
+
+    vec2 size = bounds.max - bounds.min;
+
+    std::vector<QuadBuildItem> build_items(items.size());
+
+    for(size_t i = 0; i < items.size(); i++) {
+        QuadItem* item = items[i];
+
+        item->node_count = 0;
+
+        int min_x = quadtree_cell_coord(item->quadItemBounds.min.x, bounds.min.x, size.x);
+        int max_x = quadtree_cell_coord(item->quadItemBounds.max.x, bounds.min.x, size.x);
+        int min_y = quadtree_cell_coord(item->quadItemBounds.min.y, bounds.min.y, size.y);
+        int max_y = quadtree_cell_coord(item->quadItemBounds.max.y, bounds.min.y, size.y);
+
+        int level = std::min(quadtree_cell_levels(min_x, max_x), quadtree_cell_levels(min_y, max_y));
+
+        unsigned int code = 0;
+
+        if(level > 0) {
+            code = quadtree_spread_bits(min_x) | (quadtree_spread_bits(min_y) << 1);
+
+            // keep only the path to the cell
+            int shift = 2 * (QUADTREE_BUILD_LEVELS - level);
+            if(shift > 0) code &= ~((1u << shift) - 1);
+        }
+
+        build_items[i].code  = code;
+        build_items[i].level = level;
+        build_items[i].item  = item;
+    }
+
+    std::sort(build_items.begin(), build_items.end(), quadtree_build_item_compare);
+
+    QuadBuildItem* begin = build_items.empty() ? 0 : &(build_items[0]);
+    QuadBuildItem* end   = begin + build_items.size();
+
+    std::vector<QuadItem*> straddling;
+
+#if SDL_VERSION_ATLEAST(2,0,0)
+    if(thread_count <= 0) thread_count = SDL_GetCPUCount();
+#else
+    if(thread_count <= 0) thread_count = 1;
+#endif
+
+    int nodes_added = 0;
+    int items_added = 0;
+
+    if(thread_count <= 1 || build_items.size() < QUADTREE_PARALLEL_BUILD_MIN_ITEMS) {
+        root->build(begin, end, straddling, 0, nodes_added, items_added);
+    } else {
+
+        QuadBuildQueue queue;
+
+        // use several jobs per thread to balance the load
+        root->buildJobs(begin, end, straddling, 0, build_items.size() / (thread_count * 4), queue.jobs, nodes_added);
+
+        thread_count = std::min(thread_count, (int) queue.jobs.size());
+
+        std::vector<SDL_Thread*> threads;
+
+        for(int i = 1; i < thread_count; i++) {
+#if SDL_VERSION_ATLEAST(2,0,0)
+            SDL_Thread* thread = SDL_CreateThread( quadtree_build_thread, "quadtree_build", &queue );
+#else
+            SDL_Thread* thread = SDL_CreateThread( quadtree_build_thread, &queue );
+#endif
+            if(thread != 0) threads.push_back(thread);
+        }
+
+        // this thread also takes part
+        quadtree_build_thread(&queue);
+
+        for(size_t i = 0; i < threads.size(); i++) {
+            SDL_WaitThread(threads[i], 0);
+        }
+
+        for(std::vector<QuadBuildJob*>::iterator it = queue.jobs.begin(); it != queue.jobs.end(); it++) {
+            nodes_added += (*it)->nodes_added;
+            items_added += (*it)->items_added;
+            delete (*it);
+        }
+    }
+
+    node_count += nodes_added;
+    item_count += items_added;
+
+    root->countItems();
+}
+
 int QuadTree::drawNodesInFrustum(Frustum& frustum) {
     return root->draw(frustum);
 }
@@ -517,3 +1256,223 @@ void QuadTree::outline() {
 void QuadTree::outlineItems() {
     root->outlineItems();
 }
+
+//Flat Quad TREE
+
+FlatQuadTree::FlatQuadTree(Bounds2D bounds, int max_node_depth, int max_node_items) {
+    this->bounds = bounds;
+
+    this->max_node_depth = max_node_depth;
+    this->max_node_items = max_node_items;
+
+    item_count        = 0;
+    node_count        = 0;
+    unique_item_count = 0;
+
+    dirty = true;
+}
+
+void FlatQuadTree::addItem(QuadItem* item) {
+    all_items.push_back(item);
+    unique_item_count++;
+    dirty = true;
+}
+
+void FlatQuadTree::clear() {
+    all_items.clear();
+    nodes.clear();
+    node_items.clear();
+
+    unique_item_count = 0;
+    item_count        = 0;
+    node_count        = 0;
+
+    dirty = true;
+}
+
+// nodes split under the same rules as QuadNode::addItem,
+// so the resulting tree has the same shape as a QuadTree
+
+void FlatQuadTree::buildNode(int node_index, std::vector<QuadItem*>& items, int depth) {
+
+    if(depth >= max_node_depth || items.size() <= max_node_items) {
+        FlatQuadNode& node = nodes[node_index];
+
+        node.item_start = node_items.size();
+        node.item_count = items.size();
+
+        for(std::vector<QuadItem*>::iterator it = items.begin(); it != items.end(); it++) {
+            (*it)->node_count++;
+            node_items.push_back(*it);
+        }
+
+        return;
+    }
+
+    Bounds2D node_bounds = nodes[node_index].bounds;
+
+    vec2 middle = node_bounds.centre() - node_bounds.min;
+    vec2 relmax = node_bounds.max - node_bounds.min;
+
+    Bounds2D child_bounds[4];
+
+    //top left
+    child_bounds[0] = Bounds2D( node_bounds.min, node_bounds.min + middle );
+    //top right
+    child_bounds[1] = Bounds2D( node_bounds.min + vec2(middle.x, 0.0), node_bounds.min + vec2(relmax.x,middle.y) );
+    //bottom left
+    child_bounds[2] = Bounds2D( node_bounds.min + vec2(0.0, middle.y), node_bounds.min + vec2(middle.x,relmax.y) );
+    //bottom right
+    child_bounds[3] = Bounds2D( node_bounds.min + middle, node_bounds.max );
+
+    int first_child = nodes.size();
+
+    nodes[node_index].first_child = first_child;
+
+    for(int i=0;i<4;i++) {
+        FlatQuadNode child;
+        child.bounds      = child_bounds[i];
+        child.first_child = -1;
+        child.item_start  = 0;
+        child.item_count  = 0;
+        nodes.push_back(child);
+    }
+
+    std::vector<QuadItem*> child_items;
+    child_items.reserve(items.size());
+
+    for(int i=0;i<4;i++) {
+        child_items.clear();
+
+        for(std::vector<QuadItem*>::iterator it = items.begin(); it != items.end(); it++) {
+            if(child_bounds[i].overlaps((*it)->quadItemBounds)) child_items.push_back(*it);
+        }
+
+        buildNode(first_child + i, child_items, depth + 1);
+    }
+}
+
+void FlatQuadTree::build() {
+
+    nodes.clear();
+    node_items.clear();
+
+    FlatQuadNode root;
+    root.bounds      = bounds;
+    root.first_child = -1;
+    root.item_start  = 0;
+    root.item_count  = 0;
+
+    nodes.push_back(root);
+
+    for(std::vector<QuadItem*>::iterator it = all_items.begin(); it != all_items.end(); it++) {
+        (*it)->node_count = 0;
+    }
+
+    std::vector<QuadItem*> items = all_items;
+
+    buildNode(0, items, 1);
+
+    item_count = node_items.size();
+    node_count = nodes.size();
+
+    dirty = false;
+}
+
+void FlatQuadTree::visitItemsAt(const vec2 & pos, VisitFunctor<QuadItem> & visit) {
+
+    if(dirty) build();
+
+    int index = 0;
+
+    while(nodes[index].first_child != -1) {
+        int first_child = nodes[index].first_child;
+
+        index = -1;
+
+        for(int i=0;i<4;i++) {
+            if(nodes[first_child+i].bounds.contains(pos)) {
+                index = first_child+i;
+                break;
+            }
+        }
+
+        if(index == -1) return;
+    }
+
+    const FlatQuadNode& node = nodes[index];
+
+    for(int i = node.item_start; i < node.item_start + node.item_count; i++) {
+        visit(node_items[i]);
+    }
+}
+
+void FlatQuadTree::visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadItem> & visit) {
+
+    if(dirty) build();
+
+    stack.clear();
+    stack.push_back(0);
+
+    while(!stack.empty()) {
+        const FlatQuadNode& node = nodes[stack.back()];
+        stack.pop_back();
+
+        if(node.first_child == -1) {
+            for(int i = node.item_start; i < node.item_start + node.item_count; i++) {
+                visit(node_items[i]);
+            }
+            continue;
+        }
+
+        //visit each corner, in the same order as QuadNode
+        for(int i=3;i>=0;i--) {
+            int child = node.first_child + i;
+            if(!nodes[child].empty() && frustum.intersects(nodes[child].bounds)) stack.push_back(child);
+        }
+    }
+}
+
+void FlatQuadTree::visitItemsInBounds(const Bounds2D & bounds, VisitFunctor<QuadItem> & visit) {
+
+    if(dirty) build();
+
+    stack.clear();
+    stack.push_back(0);
+
+    while(!stack.empty()) {
+        const FlatQuadNode& node = nodes[stack.back()];
+        stack.pop_back();
+
+        if(node.first_child == -1) {
+            for(int i = node.item_start; i < node.item_start + node.item_count; i++) {
+                visit(node_items[i]);
+            }
+            continue;
+        }
+
+        //visit each corner, in the same order as QuadNode
+        for(int i=3;i>=0;i--) {
+            int child = node.first_child + i;
+            if(!nodes[child].empty() && bounds.overlaps(nodes[child].bounds)) stack.push_back(child);
+        }
+    }
+}
+
+void FlatQuadTree::outline() {
+
+    if(dirty) build();
+
+    for(std::vector<FlatQuadNode>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+        if(it->item_count > 0) it->bounds.draw();
+    }
+}
+
+void FlatQuadTree::outlineItems() {
+
+    if(dirty) build();
+
+    for(std::vector<QuadItem*>::iterator it = node_items.begin(); it != node_items.end(); it++) {
+        (*it)->quadItemBounds.draw();
+    }
+}
@@ -30,6 +30,7 @@
 
 #include <set>
 #include <list>
+#include <vector>
 
 #include "gl.h"
 #include "bounds.h"
@@ -39,6 +40,8 @@ class QuadItem {
 public:
     Bounds2D quadItemBounds;
     int node_count;
+    unsigned int quad_query_stamp; //last query that returned this item
+    QuadItem() : node_count(0), quad_query_stamp(0) {};
     virtual ~QuadItem() {};
     virtual void updateQuadItemBounds() {};
     virtual void drawQuadItem() {};
@@ -51,6 +54,8 @@ class VisitFunctor{
 };
 
 class QuadTree;
+class QuadBuildItem;
+class QuadBuildJob;
 
 class QuadNode {
     GLuint listid;
@@ -65,6 +70,9 @@ class QuadNode {
     int getChildIndex(const vec2 & pos) const;
     void addToChild(QuadItem* item);
 
+    void split(bool count_nodes = true);
+    void collapse();
+
     int depth;
 
     QuadNode* parent;
@@ -72,24 +80,38 @@ public:
     bool allowMoreItems();
     int usedChildren();
 
-    QuadNode(QuadTree* tree, QuadNode* parent, Bounds2D itembounds, int parent_depth);
+    QuadNode(QuadTree* tree, QuadNode* parent, Bounds2D itembounds, int parent_depth, bool count_node = true);
     ~QuadNode();
 
     void addItem(QuadItem* item); //if not subdivided, subdivide, add to correct subdivided node.
 
+    // bulk building. build() does not update the tree or item counters so
+    // separate subtrees can be built in parallel, followed by countItems()
+    void build(QuadBuildItem* begin, QuadBuildItem* end, std::vector<QuadItem*>& straddling, unsigned int code, int& nodes_added, int& items_added);
+    void buildJobs(QuadBuildItem* begin, QuadBuildItem* end, std::vector<QuadItem*>& straddling, unsigned int code, size_t job_items, std::vector<QuadBuildJob*>& jobs, int& nodes_added);
+    void countItems();
+    bool removeItem(QuadItem* item, bool use_bounds = true); //remove from leaves overlapping the item bounds, collapse under-populated children
+
     int getItemsAt(std::set<QuadItem*>& itemset, vec2 pos);
     void getLeavesInFrustum(std::set<QuadNode*>& nodeset, Frustum& frustum);
     int getItemsInFrustum(std::set<QuadItem*>& itemset, Frustum& frustum);
     int getItemsInBounds(std::set<QuadItem*>& itemset, Bounds2D& bounds) const;
 
-    void visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadItem> & visit);
+    // plane_mask holds the frustum planes this node is not already known to be inside of
+    void visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadItem> & visit, unsigned int plane_mask = FRUSTUM_ALL_PLANES);
     void visitItemsInBounds(const Bounds2D & bounds, VisitFunctor<QuadItem> & visit);
     void visitItemsAt(const vec2 & pos, VisitFunctor<QuadItem> & visit);
-    void visitLeavesInFrustum(const Frustum & frustum, VisitFunctor<QuadNode> & visit);
+    void visitLeavesInFrustum(const Frustum & frustum, VisitFunctor<QuadNode> & visit, unsigned int plane_mask = FRUSTUM_ALL_PLANES);
+
+    void visitItems(VisitFunctor<QuadItem> & visit);
+    void visitLeaves(VisitFunctor<QuadNode> & visit);
+
+    int nearest(const vec2& pos, int k, VisitFunctor<QuadItem> & visit);
+    QuadItem* raycast(const vec2& origin, const vec2& dir, float* distance);
 
     bool empty();
     void generateLists();
-    int draw(Frustum& frustum);
+    int draw(Frustum& frustum, unsigned int plane_mask = FRUSTUM_ALL_PLANES);
     void outline();
     void outlineItems();
 };
@@ -98,6 +120,12 @@ public:
 class QuadTree {
     Bounds2D bounds;
     QuadNode* root;
+    // shared by all trees, as items keep the stamp of their last query
+    static unsigned int query_stamp;
+
+    static unsigned int nextQueryStamp();
+
+    friend class QuadNode;
 public:
     int unique_item_count;
     int item_count;
@@ -110,11 +138,25 @@ public:
     int getItemsInFrustum(std::set<QuadItem*>& itemset, Frustum& frustum);
     int getItemsInBounds(std::set<QuadItem*>& itemset, Bounds2D& bounds) const;
 
+    //append unique items to a reusable vector, optionally testing the bounds of each item
+    int getItemsAt(std::vector<QuadItem*>& items, const vec2& pos, bool test_item_bounds = false);
+    int getItemsInFrustum(std::vector<QuadItem*>& items, const Frustum& frustum, bool test_item_bounds = false);
+    int getItemsInBounds(std::vector<QuadItem*>& items, const Bounds2D& bounds, bool test_item_bounds = false);
+
     void visitItemsAt(const vec2 & pos, VisitFunctor<QuadItem> & visit);
     void visitLeavesInFrustum(const Frustum & frustum, VisitFunctor<QuadNode> & visit);
     void visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadItem> & visit);
     void visitItemsInBounds(const Bounds2D & bounds, VisitFunctor<QuadItem> & visit);
+
+    //visit up to k unique items closest to pos, nearest first
+    int nearest(const vec2& pos, int k, VisitFunctor<QuadItem> & visit);
+    //first item hit by the ray, distance is set as a multiple of dir
+    QuadItem* raycast(const vec2& origin, const vec2& dir, float* distance = 0);
+
     void addItem(QuadItem* item);
+    bool removeItem(QuadItem* item);
+    void updateItem(QuadItem* item);
+    void build(std::vector<QuadItem*>& items, int thread_count = 0);
     void generateLists();
     int drawNodesInFrustum(Frustum& frustum);
     QuadTree(Bounds2D bounds, int max_node_depth, int max_node_items);
@@ -123,4 +165,51 @@ public:
     void outlineItems();
 };
 
+// alternative storage with nodes in one contiguous array and the items
+// of each leaf packed together. items are added and the tree is rebuilt
+// before the next query.
+
+class FlatQuadNode {
+public:
+    Bounds2D bounds;
+    int first_child; // index of the first of 4 consecutive children, or -1 for a leaf
+    int item_start;
+    int item_count;
+
+    bool empty() const { return first_child == -1 && item_count == 0; };
+};
+
+class FlatQuadTree {
+    Bounds2D bounds;
+
+    std::vector<FlatQuadNode> nodes;
+    std::vector<QuadItem*> node_items;
+    std::vector<QuadItem*> all_items;
+
+    std::vector<int> stack;
+
+    bool dirty;
+
+    void buildNode(int node_index, std::vector<QuadItem*>& items, int depth);
+public:
+    int unique_item_count;
+    int item_count;
+    int node_count;
+    int max_node_depth;
+    int max_node_items;
+
+    FlatQuadTree(Bounds2D bounds, int max_node_depth, int max_node_items);
+
+    void addItem(QuadItem* item);
+    void clear();
+    void build();
+
+    void visitItemsAt(const vec2 & pos, VisitFunctor<QuadItem> & visit);
+    void visitItemsInFrustum(const Frustum & frustum, VisitFunctor<QuadItem> & visit);
+    void visitItemsInBounds(const Bounds2D & bounds, VisitFunctor<QuadItem> & visit);
+
+    void outline();
+    void outlineItems();
+};
+
 #endif
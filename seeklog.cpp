@@ -32,15 +32,103 @@
 #include <unistd.h>
 #endif
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/select.h>
+#endif
+
+#include <cerrno>
+
+#include <sys/stat.h>
+
+#include <cstring>
+#include <algorithm>
+
+#include <zlib.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SEEKLOG_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 long long gSeekLogMaxBufferSize = 104857600;
 
+// uncompressed distance between checkpoints in compressed logs
+long long gSeekLogCheckpointSpan = 4194304;
+
+#ifdef SEEKLOG_SSE2
+static inline int seeklog_ctz(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// append the offset after each newline in data to line_starts
+
+void seeklog_scan_newlines(const char* data, size_t length, long long base_offset, std::vector<long long>& line_starts) {
+
+    size_t i = 0;
+
+#ifdef SEEKLOG_SSE2
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    for(; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (data + i));
+
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        while(mask) {
+            line_starts.push_back(base_offset + i + seeklog_ctz(mask) + 1);
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for(; i < length; i++) {
+        if(data[i] == '\n') line_starts.push_back(base_offset + i + 1);
+    }
+}
+
+//BaseLog
+
+size_t BaseLog::getNextLines(LineBatch& batch, size_t max_lines) {
+
+    batch.clear();
+
+    std::string line;
+
+    while(batch.size() < max_lines && getNextLine(line)) {
+        batch.addLine(line.data(), line.size());
+    }
+
+    return batch.size();
+}
+
 //StreamLog
 
-StreamLog::StreamLog() {
+#define STREAM_LOG_RING_SIZE   16384
+#define STREAM_LOG_READ_CHUNK  65536
+
+StreamLog::StreamLog(bool threaded) : threaded(threaded) {
     this->stream = &std::cin;
 
     fcntl_fail = false;
 
+    max_lines_per_frame = 0;
+    frame_line_count    = 0;
+
 #ifdef _WIN32
     stdin_handle = GetStdHandle(STD_INPUT_HANDLE);
 #else
@@ -51,13 +139,172 @@ StreamLog::StreamLog() {
         fcntl_fail = true;
     }
 #endif
+
+#ifdef STREAM_LOG_THREADED
+    ring_mask     = 0;
+    reader_thread = 0;
+
+    SDL_AtomicSet(&ring_head, 0);
+    SDL_AtomicSet(&ring_tail, 0);
+    SDL_AtomicSet(&reader_state, STREAM_LOG_READER_RUNNING);
+
+    if(threaded) {
+        line_ring.resize(STREAM_LOG_RING_SIZE);
+        ring_mask = STREAM_LOG_RING_SIZE - 1;
+
+        reader_thread = SDL_CreateThread( StreamLog::startReader, "stream_log", this );
+    }
+#else
+    // keep the blocking reads of the unthreaded mode
+    this->threaded = false;
+#endif
 }
 
 StreamLog::~StreamLog() {
+#ifdef STREAM_LOG_THREADED
+    if(reader_thread != 0) {
+        SDL_AtomicSet(&reader_state, STREAM_LOG_READER_EXIT);
+        SDL_WaitThread(reader_thread, 0);
+        reader_thread = 0;
+    }
+#endif
+}
+
+// limit the number of lines returned before getNextLine returns false,
+// so that a burst of input is spread over multiple frames
+void StreamLog::setMaxLinesPerFrame(int max_lines) {
+    max_lines_per_frame = max_lines;
+}
+
+#ifdef STREAM_LOG_THREADED
+
+int StreamLog::startReader(void* log) {
+    (static_cast<StreamLog*>(log))->readLines();
+    return 0;
+}
+
+// called from the reader thread. waits while the ring is full
+bool StreamLog::pushLine(std::string& line) {
+
+    unsigned int head = (unsigned int) SDL_AtomicGet(&ring_head);
+
+    while(head - (unsigned int) SDL_AtomicGet(&ring_tail) > ring_mask) {
+        if(SDL_AtomicGet(&reader_state) == STREAM_LOG_READER_EXIT) return false;
+        SDL_Delay(1);
+    }
+
+    std::string& slot = line_ring[head & ring_mask];
+
+    slot.swap(line);
+    line.clear();
+
+    SDL_AtomicSet(&ring_head, (int) (head + 1));
+
+    return true;
+}
+
+bool StreamLog::popLine(std::string& line) {
+
+    unsigned int tail = (unsigned int) SDL_AtomicGet(&ring_tail);
+
+    if(tail == (unsigned int) SDL_AtomicGet(&ring_head)) return false;
+
+    line.swap(line_ring[tail & ring_mask]);
+
+    SDL_AtomicSet(&ring_tail, (int) (tail + 1));
+
+    return true;
+}
+
+void StreamLog::readLines() {
+    std::vector<char> buffer(STREAM_LOG_READ_CHUNK);
+    std::string partial;
+
+    while(SDL_AtomicGet(&reader_state) == STREAM_LOG_READER_RUNNING) {
+
+        size_t bytes_read = 0;
+
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+
+        // wake up periodically to check if the log is being destroyed
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 100000;
+
+        int ready = select(STDIN_FILENO+1, &readfds, 0, 0, &timeout);
+
+        if(ready < 0 && errno != EINTR) break;
+        if(ready <= 0) continue;
+
+        ssize_t ret = read(STDIN_FILENO, &(buffer[0]), buffer.size());
+
+        if(ret < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            break;
+        }
+
+        if(ret == 0) break;
+
+        bytes_read = (size_t) ret;
+
+        const char* start = &(buffer[0]);
+        const char* end   = start + bytes_read;
+
+        while(start < end) {
+            const char* eol = (const char*) memchr(start, '\n', end - start);
+
+            if(eol == 0) {
+                partial.append(start, end - start);
+                break;
+            }
+
+            partial.append(start, eol - start);
+
+            //remove carriage returns
+            if(partial.size() > 0 && partial[partial.size()-1] == '\r') {
+                partial.resize(partial.size() - 1);
+            }
+
+            if(!pushLine(partial)) return;
+
+            start = eol + 1;
+        }
+    }
+
+    // last line may not have been terminated
+    if(!partial.empty() && SDL_AtomicGet(&reader_state) == STREAM_LOG_READER_RUNNING) {
+        if(partial[partial.size()-1] == '\r') partial.resize(partial.size() - 1);
+        pushLine(partial);
+    }
+
+    // flag end of input unless we were told to exit
+    SDL_AtomicCAS(&reader_state, STREAM_LOG_READER_RUNNING, STREAM_LOG_READER_EOF);
 }
 
+#endif
+
 bool StreamLog::getNextLine(std::string& line) {
 
+    // end of this frame's allowance
+    if(max_lines_per_frame > 0 && frame_line_count >= max_lines_per_frame) {
+        frame_line_count = 0;
+        return false;
+    }
+
+#ifdef STREAM_LOG_THREADED
+    if(threaded) {
+        if(!popLine(line)) {
+            frame_line_count = 0;
+            return false;
+        }
+
+        frame_line_count++;
+        return true;
+    }
+#endif
+
     //try and fix the stream
     if(isFinished()) stream->clear();
 
@@ -80,14 +327,63 @@ bool StreamLog::getNextLine(std::string& line) {
     }
 
     if(isFinished()) {
+        frame_line_count = 0;
         return false;
     }
 
+    frame_line_count++;
+
     return true;
 }
 
+size_t StreamLog::getNextLines(LineBatch& batch, size_t max_lines) {
+
+#ifndef STREAM_LOG_THREADED
+    return BaseLog::getNextLines(batch, max_lines);
+#else
+    if(!threaded) return BaseLog::getNextLines(batch, max_lines);
+
+    batch.clear();
+
+    if(max_lines_per_frame > 0) {
+        if(frame_line_count >= max_lines_per_frame) {
+            frame_line_count = 0;
+            return 0;
+        }
+        max_lines = std::min(max_lines, (size_t) (max_lines_per_frame - frame_line_count));
+    }
+
+    unsigned int tail = (unsigned int) SDL_AtomicGet(&ring_tail);
+    unsigned int head = (unsigned int) SDL_AtomicGet(&ring_head);
+
+    size_t count = std::min((size_t) (head - tail), max_lines);
+
+    for(size_t i = 0; i < count; i++) {
+        const std::string& line = line_ring[(tail + i) & ring_mask];
+        batch.addLine(line.data(), line.size());
+    }
+
+    SDL_AtomicSet(&ring_tail, (int) (tail + count));
+
+    if(count == 0) {
+        frame_line_count = 0;
+    } else {
+        frame_line_count += count;
+    }
+
+    return count;
+#endif
+}
+
 bool StreamLog::isFinished() {
 
+#ifdef STREAM_LOG_THREADED
+    if(threaded) {
+        return SDL_AtomicGet(&reader_state) != STREAM_LOG_READER_RUNNING
+            && SDL_AtomicGet(&ring_tail) == SDL_AtomicGet(&ring_head);
+    }
+#endif
+
     if(fcntl_fail || stream->fail() || stream->eof()) {
         return true;
     }
@@ -95,134 +391,1764 @@ bool StreamLog::isFinished() {
     return false;
 }
 
-// SeekLog
+// SeekLogDecoder
 
-SeekLog::SeekLog(std::string logfile) {
-    this->logfile = logfile;
+// a point in a compressed log that decompression can be restarted from
 
-    this->stream = 0;
+class SeekLogCheckpoint {
+public:
+    long long in_offset;
+    long long out_offset;
+    int bits;
+    std::vector<unsigned char> window;
 
-    if(!readFully()) {
-        throw SeekLogException(logfile);
-    }
-}
+    SeekLogCheckpoint() : in_offset(0), out_offset(0), bits(0) {};
+};
 
-bool SeekLog::readFully() {
+#define SEEKLOG_INPUT_CHUNK 262144
 
-    if(stream!=0) delete stream;
+class SeekLogDecoder {
+protected:
+    std::ifstream in;
 
-    std::ifstream* file = new std::ifstream(logfile.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    std::vector<char> input;
+    size_t input_length;
+    long long input_base;
 
-    file_size = file->tellg();
+    std::vector<SeekLogCheckpoint> checkpoints;
 
-    if(!file->is_open()) {
-        delete file;
-        return false;
-    }
+    long long out_offset;
+    bool finished;
 
-    file->seekg (0, std::ios::beg);
+    bool fillInput();
+    void addCheckpoint(long long in_offset, long long out_offset, int bits, std::vector<unsigned char>* window);
 
-    //dont load into memory if larger than
-    if(file_size > gSeekLogMaxBufferSize) {
-        stream = file;
-        return true;
-    }
+    virtual bool restart(const SeekLogCheckpoint& checkpoint) = 0;
+public:
+    SeekLogDecoder();
+    virtual ~SeekLogDecoder() {};
 
+    bool open(const std::string& filename);
+    bool reset(size_t checkpoint_index);
 
-    //buffer entire file into memory
-    char* filebuffer = new char[file_size+1];
+    virtual size_t read(char* buffer, size_t size) = 0;
+    virtual long long getInputOffset() const = 0;
 
-    if(!file->read(filebuffer, file_size)) {
-        file->close();
-        delete file;
-        delete [] filebuffer;
-        return false;
-    }
-    filebuffer[file_size] = '\0';
+    long long getOutputOffset() const { return out_offset; };
+    bool isFinished() const { return finished; };
 
-    file->close();
-    delete file;
+    size_t findCheckpointByInput(long long in_offset) const;
+    size_t findCheckpointByOutput(long long out_offset) const;
+};
 
-    stream = new std::istringstream(std::string(filebuffer));
+SeekLogDecoder::SeekLogDecoder() {
+    input.resize(SEEKLOG_INPUT_CHUNK);
+    input_length = 0;
+    input_base   = 0;
 
-    delete[] filebuffer;
+    out_offset = 0;
+    finished   = false;
 
-    return true;
+    // can always restart from the beginning
+    checkpoints.push_back(SeekLogCheckpoint());
 }
 
-SeekLog::~SeekLog() {
-    if(stream!=0) delete stream;
+bool SeekLogDecoder::open(const std::string& filename) {
+    in.open(filename.c_str(), std::ios::in | std::ios::binary);
+
+    if(!in.is_open()) return false;
+
+    return reset(0);
 }
 
-float SeekLog::getPercent() {
-    return current_percent;
+bool SeekLogDecoder::fillInput() {
+
+    input_base += input_length;
+
+    in.read(&(input[0]), input.size());
+
+    input_length = (size_t) in.gcount();
+
+    return input_length > 0;
 }
 
-void SeekLog::setPointer(std::streampos pointer) {
-    stream->clear();
-    stream->seekg(pointer);
+void SeekLogDecoder::addCheckpoint(long long in_offset, long long out_offset, int bits, std::vector<unsigned char>* window) {
+
+    if(out_offset < checkpoints.back().out_offset + gSeekLogCheckpointSpan) return;
+
+    checkpoints.push_back(SeekLogCheckpoint());
+
+    SeekLogCheckpoint& checkpoint = checkpoints.back();
+
+    checkpoint.in_offset  = in_offset;
+    checkpoint.out_offset = out_offset;
+    checkpoint.bits       = bits;
+
+    if(window != 0) checkpoint.window.swap(*window);
 }
 
-std::streampos SeekLog::getPointer() {
-    return stream->tellg();
+bool SeekLogDecoder::reset(size_t checkpoint_index) {
+
+    const SeekLogCheckpoint& checkpoint = checkpoints[checkpoint_index];
+
+    // if the checkpoint is part way through a byte start from the byte before
+    long long position = checkpoint.in_offset - (checkpoint.bits ? 1 : 0);
+
+    in.clear();
+    in.seekg((std::streampos) position);
+
+    if(in.fail()) return false;
+
+    input_base   = position;
+    input_length = 0;
+
+    out_offset = checkpoint.out_offset;
+    finished   = false;
+
+    return restart(checkpoint);
 }
 
-void SeekLog::seekTo(float percent) {
+size_t SeekLogDecoder::findCheckpointByInput(long long in_offset) const {
+    size_t i = checkpoints.size() - 1;
 
-    std::streampos mem_offset = (std::streampos) (percent * file_size);
+    while(i > 0 && checkpoints[i].in_offset > in_offset) i--;
 
-    setPointer(mem_offset);
-    
-    //throw away end of line
-    if(mem_offset != (std::streampos)0) {
-        std::string eol;
-        getNextLine(eol);
-    }
+    return i;
 }
 
-bool SeekLog::getNextLine(std::string& line) {
+size_t SeekLogDecoder::findCheckpointByOutput(long long out_offset) const {
+    size_t i = checkpoints.size() - 1;
 
-    //try and fix the stream
-    if(isFinished()) stream->clear();
+    while(i > 0 && checkpoints[i].out_offset > out_offset) i--;
 
-    std::getline(*stream, line);
-    
-    //remove carriage returns
-    if (line.size() > 0 && line[line.size()-1] == '\r') {
-        line.resize(line.size() - 1);
+    return i;
+}
+
+// GzipSeekLogDecoder
+// checkpoints are taken at deflate block boundaries along with
+// the preceding 32K of output needed to resume decompression
+
+#define SEEKLOG_GZIP_WINDOW 32768
+
+class GzipSeekLogDecoder : public SeekLogDecoder {
+    z_stream strm;
+    bool initialized;
+    bool raw;
+
+    std::vector<unsigned char> window;
+    size_t window_pos;
+    size_t window_fill;
+
+    bool refill();
+    bool skipInput(size_t bytes);
+
+    void updateWindow(const unsigned char* data, size_t length);
+    void copyWindow(std::vector<unsigned char>& copy);
+protected:
+    bool restart(const SeekLogCheckpoint& checkpoint);
+public:
+    GzipSeekLogDecoder();
+    ~GzipSeekLogDecoder();
+
+    size_t read(char* buffer, size_t size);
+    long long getInputOffset() const;
+};
+
+GzipSeekLogDecoder::GzipSeekLogDecoder() {
+    memset(&strm, 0, sizeof(strm));
+    initialized = false;
+    raw = false;
+
+    window.resize(SEEKLOG_GZIP_WINDOW);
+    window_pos  = 0;
+    window_fill = 0;
+}
+
+GzipSeekLogDecoder::~GzipSeekLogDecoder() {
+    if(initialized) inflateEnd(&strm);
+}
+
+long long GzipSeekLogDecoder::getInputOffset() const {
+    return input_base + (input_length - strm.avail_in);
+}
+
+bool GzipSeekLogDecoder::restart(const SeekLogCheckpoint& checkpoint) {
+
+    if(initialized) inflateEnd(&strm);
+
+    memset(&strm, 0, sizeof(strm));
+
+    initialized = false;
+
+    // resume mid stream as raw deflate data
+    raw = checkpoint.out_offset > 0;
+
+    if(inflateInit2(&strm, raw ? -15 : 15+16) != Z_OK) return false;
+
+    initialized = true;
+
+    strm.next_in  = (Bytef*) &(input[0]);
+    strm.avail_in = 0;
+
+    if(checkpoint.bits) {
+        int c = in.get();
+
+        if(c == EOF) return false;
+
+        input_base++;
+
+        inflatePrime(&strm, checkpoint.bits, c >> (8 - checkpoint.bits));
     }
 
-    if(stream->fail()) {
-        return false;
+    if(raw) {
+        inflateSetDictionary(&strm, &(checkpoint.window[0]), checkpoint.window.size());
     }
 
-    current_percent = (float) stream->tellg() / file_size;
-    //debugLog("current_percent = %.2f\n", current_percent);
+    window_pos  = 0;
+    window_fill = 0;
 
     return true;
 }
 
-// temporarily move the file pointer to get a line somewhere else in the file
-bool SeekLog::getNextLineAt(std::string& line, float percent) {
-    std::streampos currpointer = getPointer();
-
-    seekTo(percent);
+bool GzipSeekLogDecoder::refill() {
+    if(!fillInput()) return false;
 
-    bool success = getNextLine(line);
+    strm.next_in  = (Bytef*) &(input[0]);
+    strm.avail_in = input_length;
 
-    //set the pointer back
-    setPointer(currpointer);
-    
-    return success;
+    return true;
 }
 
-bool SeekLog::isFinished() {
-    bool finished = false;
+bool GzipSeekLogDecoder::skipInput(size_t bytes) {
 
-    if(stream->fail() || stream->eof()) {
-        //debugLog("stream is finished");
-        finished=true;
+    while(bytes > 0) {
+        if(strm.avail_in == 0 && !refill()) return false;
+
+        size_t skip = std::min(bytes, (size_t) strm.avail_in);
+
+        strm.next_in  += skip;
+        strm.avail_in -= skip;
+
+        bytes -= skip;
     }
 
-    return finished;
+    return true;
+}
+
+void GzipSeekLogDecoder::updateWindow(const unsigned char* data, size_t length) {
+
+    if(length >= SEEKLOG_GZIP_WINDOW) {
+        memcpy(&(window[0]), data + length - SEEKLOG_GZIP_WINDOW, SEEKLOG_GZIP_WINDOW);
+        window_pos  = 0;
+        window_fill = SEEKLOG_GZIP_WINDOW;
+        return;
+    }
+
+    while(length > 0) {
+        size_t copy = std::min(length, SEEKLOG_GZIP_WINDOW - window_pos);
+
+        memcpy(&(window[window_pos]), data, copy);
+
+        window_pos = (window_pos + copy) % SEEKLOG_GZIP_WINDOW;
+        window_fill = std::min(window_fill + copy, (size_t) SEEKLOG_GZIP_WINDOW);
+
+        data   += copy;
+        length -= copy;
+    }
+}
+
+void GzipSeekLogDecoder::copyWindow(std::vector<unsigned char>& copy) {
+
+    copy.resize(window_fill);
+
+    if(window_fill < SEEKLOG_GZIP_WINDOW) {
+        memcpy(&(copy[0]), &(window[0]), window_fill);
+        return;
+    }
+
+    size_t tail = SEEKLOG_GZIP_WINDOW - window_pos;
+
+    memcpy(&(copy[0]),    &(window[window_pos]), tail);
+    memcpy(&(copy[tail]), &(window[0]),          window_pos);
+}
+
+size_t GzipSeekLogDecoder::read(char* buffer, size_t size) {
+
+    if(finished || !initialized) return 0;
+
+    strm.next_out  = (Bytef*) buffer;
+    strm.avail_out = size;
+
+    while(strm.avail_out > 0) {
+
+        if(strm.avail_in == 0 && !refill()) {
+            finished = true;
+            break;
+        }
+
+        Bytef* output_start = strm.next_out;
+
+        int ret = inflate(&strm, Z_BLOCK);
+
+        if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR) {
+            debugLog("inflate failed: %s", strm.msg != 0 ? strm.msg : "unknown error");
+            finished = true;
+            break;
+        }
+
+        updateWindow(output_start, strm.next_out - output_start);
+
+        if(ret == Z_STREAM_END) {
+
+            // skip the gzip trailer if the member was resumed as raw deflate data
+            if(raw && !skipInput(8)) {
+                finished = true;
+                break;
+            }
+
+            // check for another gzip member
+            if(strm.avail_in == 0 && !refill()) {
+                finished = true;
+                break;
+            }
+
+            inflateReset2(&strm, 15+16);
+            raw = false;
+            continue;
+        }
+
+        // at the end of a block that is not the last block
+        if((strm.data_type & 128) && !(strm.data_type & 64)) {
+            long long position = out_offset + (size - strm.avail_out);
+
+            if(position >= checkpoints.back().out_offset + gSeekLogCheckpointSpan) {
+                std::vector<unsigned char> checkpoint_window;
+                copyWindow(checkpoint_window);
+
+                addCheckpoint(getInputOffset(), position, strm.data_type & 7, &checkpoint_window);
+            }
+        }
+    }
+
+    size_t bytes_read = size - strm.avail_out;
+
+    out_offset += bytes_read;
+
+    return bytes_read;
+}
+
+#ifdef USE_ZSTD
+
+// ZstdSeekLogDecoder
+// zstd frames are independent so checkpoints are taken at frame boundaries
+
+class ZstdSeekLogDecoder : public SeekLogDecoder {
+    ZSTD_DCtx* dctx;
+    ZSTD_inBuffer in_buffer;
+protected:
+    bool restart(const SeekLogCheckpoint& checkpoint);
+public:
+    ZstdSeekLogDecoder();
+    ~ZstdSeekLogDecoder();
+
+    size_t read(char* buffer, size_t size);
+    long long getInputOffset() const;
+};
+
+ZstdSeekLogDecoder::ZstdSeekLogDecoder() {
+    dctx = ZSTD_createDCtx();
+
+    in_buffer.src  = &(input[0]);
+    in_buffer.size = 0;
+    in_buffer.pos  = 0;
+}
+
+ZstdSeekLogDecoder::~ZstdSeekLogDecoder() {
+    if(dctx != 0) ZSTD_freeDCtx(dctx);
+}
+
+long long ZstdSeekLogDecoder::getInputOffset() const {
+    return input_base + in_buffer.pos;
+}
+
+bool ZstdSeekLogDecoder::restart(const SeekLogCheckpoint& checkpoint) {
+
+    if(dctx == 0) return false;
+
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+    in_buffer.src  = &(input[0]);
+    in_buffer.size = 0;
+    in_buffer.pos  = 0;
+
+    return true;
+}
+
+size_t ZstdSeekLogDecoder::read(char* buffer, size_t size) {
+
+    if(finished) return 0;
+
+    ZSTD_outBuffer out_buffer;
+    out_buffer.dst  = buffer;
+    out_buffer.size = size;
+    out_buffer.pos  = 0;
+
+    while(out_buffer.pos < out_buffer.size) {
+
+        if(in_buffer.pos == in_buffer.size) {
+            if(!fillInput()) {
+                finished = true;
+                break;
+            }
+
+            in_buffer.size = input_length;
+            in_buffer.pos  = 0;
+        }
+
+        size_t ret = ZSTD_decompressStream(dctx, &out_buffer, &in_buffer);
+
+        if(ZSTD_isError(ret)) {
+            debugLog("zstd decompression failed: %s", ZSTD_getErrorName(ret));
+            finished = true;
+            break;
+        }
+
+        // end of frame
+        if(ret == 0) {
+            addCheckpoint(getInputOffset(), out_offset + out_buffer.pos, 0, 0);
+        }
+    }
+
+    out_offset += out_buffer.pos;
+
+    return out_buffer.pos;
+}
+
+#endif
+
+// SeekLog
+
+SeekLog::SeekLog(std::string logfile, bool memory_map) {
+    this->logfile = logfile;
+
+    this->stream = 0;
+
+    file_size       = 0;
+    current_percent = 0.0f;
+
+    memory_mapped = false;
+    map_data      = 0;
+    map_offset    = 0;
+
+    indexed      = false;
+    current_line = 0;
+
+    decoder      = 0;
+    decode_start = 0;
+    decode_end   = 0;
+    decode_eof   = false;
+    decoded_size = -1;
+#ifdef _WIN32
+    map_file_handle = INVALID_HANDLE_VALUE;
+    map_handle      = 0;
+#else
+    map_fd = -1;
+#endif
+
+    if(openCompressed()) return;
+
+    if(memory_map) {
+        if(mapFile()) return;
+        debugLog("failed to memory map %s, falling back to stream", logfile.c_str());
+    }
+
+    if(!readFully()) {
+        throw SeekLogException(logfile);
+    }
+}
+
+// detect gzip or zstd compressed logs and decompress them on the fly
+bool SeekLog::openCompressed() {
+
+    std::ifstream file(logfile.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+
+    if(!file.is_open()) return false;
+
+    file_size = file.tellg();
+
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+
+    file.seekg(0, std::ios::beg);
+    file.read((char*) magic, 4);
+    file.close();
+
+    if(magic[0] == 0x1f && magic[1] == 0x8b) {
+        decoder = new GzipSeekLogDecoder();
+    } else if(magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef USE_ZSTD
+        decoder = new ZstdSeekLogDecoder();
+#else
+        debugLog("%s is zstd compressed but zstd support is not enabled", logfile.c_str());
+        throw SeekLogException(logfile);
+#endif
+    } else {
+        return false;
+    }
+
+    if(!decoder->open(logfile)) {
+        delete decoder;
+        decoder = 0;
+        throw SeekLogException(logfile);
+    }
+
+    decode_buffer.resize(1048576);
+
+    return true;
+}
+
+bool SeekLog::fillDecodeBuffer() {
+
+    if(decode_eof) return false;
+
+    //move any remaining partial line to the start of the buffer
+    if(decode_start > 0) {
+        if(decode_end > decode_start) {
+            memmove(&(decode_buffer[0]), &(decode_buffer[decode_start]), decode_end - decode_start);
+        }
+        decode_end  -= decode_start;
+        decode_start = 0;
+    }
+
+    if(decode_end == decode_buffer.size()) {
+        decode_buffer.resize(decode_buffer.size() * 2);
+    }
+
+    //decode in small steps so the position in the compressed file stays accurate
+    size_t bytes_read = decoder->read(&(decode_buffer[decode_end]), std::min(decode_buffer.size() - decode_end, (size_t) 65536));
+
+    if(bytes_read == 0) {
+        decode_eof = true;
+        return false;
+    }
+
+    decode_end += bytes_read;
+
+    return true;
+}
+
+bool SeekLog::restartDecoder(size_t checkpoint_index) {
+
+    decode_start = 0;
+    decode_end   = 0;
+    decode_eof   = false;
+
+    if(!decoder->reset(checkpoint_index)) {
+        decode_eof = true;
+        return false;
+    }
+
+    return true;
+}
+
+// discard decompressed data up to the specified uncompressed offset
+bool SeekLog::skipDecoded(long long pointer) {
+
+    long long position = (long long) getPointer();
+
+    //restart from the closest checkpoint unless the pointer is just ahead
+    size_t checkpoint_index = decoder->findCheckpointByOutput(pointer);
+
+    if(pointer < position || position < 0 || decoder->findCheckpointByOutput(position) != checkpoint_index) {
+        if(!restartDecoder(checkpoint_index)) return false;
+        position = decoder->getOutputOffset();
+    }
+
+    while(position < pointer) {
+
+        if(decode_start == decode_end && !fillDecodeBuffer()) return false;
+
+        size_t skip = (size_t) std::min((long long) (decode_end - decode_start), pointer - position);
+
+        decode_start += skip;
+        position     += skip;
+    }
+
+    return true;
+}
+
+// seek to a percentage of the compressed file, restarting decompression
+// from the nearest checkpoint before it
+bool SeekLog::seekCompressed(float percent) {
+
+    long long in_offset = (long long) (percent * file_size);
+
+    if(!restartDecoder(decoder->findCheckpointByInput(in_offset))) return false;
+
+    std::vector<char> discard(65536);
+
+    while(decoder->getInputOffset() < in_offset) {
+        if(decoder->read(&(discard[0]), discard.size()) == 0) {
+            decode_eof = true;
+            return false;
+        }
+    }
+
+    current_percent = (float) decoder->getInputOffset() / file_size;
+
+    //throw away end of line
+    if(in_offset > 0) {
+        LogLine eol;
+        getNextLine(eol);
+    }
+
+    return true;
+}
+
+bool SeekLog::getNextDecodedLine(LogLine& line) {
+
+    size_t search_offset = 0;
+
+    while(true) {
+        const char* start = &(decode_buffer[0]) + decode_start;
+        size_t available  = decode_end - decode_start;
+
+        const char* eol = available > search_offset ? (const char*) memchr(start + search_offset, '\n', available - search_offset) : 0;
+
+        if(eol != 0) {
+            line = LogLine(start, eol - start);
+            decode_start += (eol - start) + 1;
+            break;
+        }
+
+        search_offset = available;
+
+        if(!fillDecodeBuffer()) {
+            if(available == 0) return false;
+
+            //last line was not terminated
+            line = LogLine(start, available);
+            decode_start = decode_end;
+            break;
+        }
+    }
+
+    //remove carriage returns
+    if(line.length > 0 && line.data[line.length-1] == '\r') line.length--;
+
+    current_percent = (float) decoder->getInputOffset() / file_size;
+
+    lineRead();
+
+    return true;
+}
+
+// map the file into memory so lines can be read directly from the page cache
+bool SeekLog::mapFile() {
+
+#ifdef _WIN32
+    map_file_handle = CreateFileA(logfile.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+
+    if(map_file_handle == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+
+    if(!GetFileSizeEx(map_file_handle, &size)) {
+        unmapFile();
+        return false;
+    }
+
+    file_size = size.QuadPart;
+
+    if(file_size > 0) {
+        map_handle = CreateFileMapping(map_file_handle, 0, PAGE_READONLY, 0, 0, 0);
+
+        if(!map_handle) {
+            unmapFile();
+            return false;
+        }
+
+        map_data = (const char*) MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0);
+
+        if(!map_data) {
+            unmapFile();
+            return false;
+        }
+    }
+#else
+    map_fd = open(logfile.c_str(), O_RDONLY);
+
+    if(map_fd == -1) return false;
+
+    struct stat st;
+
+    if(fstat(map_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        unmapFile();
+        return false;
+    }
+
+    file_size = st.st_size;
+
+    // mmap of a zero length file fails, leave map_data as null
+    if(file_size > 0) {
+        void* addr = mmap(0, file_size, PROT_READ, MAP_SHARED, map_fd, 0);
+
+        if(addr == MAP_FAILED) {
+            unmapFile();
+            return false;
+        }
+
+        map_data = (const char*) addr;
+
+        posix_madvise(addr, file_size, POSIX_MADV_SEQUENTIAL);
+    }
+#endif
+
+    memory_mapped = true;
+    map_offset    = 0;
+
+    return true;
+}
+
+void SeekLog::unmapFile() {
+
+#ifdef _WIN32
+    if(map_data != 0)   UnmapViewOfFile(map_data);
+    if(map_handle != 0) CloseHandle(map_handle);
+    if(map_file_handle != INVALID_HANDLE_VALUE) CloseHandle(map_file_handle);
+
+    map_handle      = 0;
+    map_file_handle = INVALID_HANDLE_VALUE;
+#else
+    if(map_data != 0) munmap((void*) map_data, file_size);
+    if(map_fd != -1)  close(map_fd);
+
+    map_fd = -1;
+#endif
+
+    map_data      = 0;
+    map_offset    = 0;
+    memory_mapped = false;
+}
+
+bool SeekLog::readFully() {
+
+    if(stream!=0) delete stream;
+
+    std::ifstream* file = new std::ifstream(logfile.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+
+    file_size = file->tellg();
+
+    if(!file->is_open()) {
+        delete file;
+        return false;
+    }
+
+    file->seekg (0, std::ios::beg);
+
+    //dont load into memory if larger than
+    if(file_size > gSeekLogMaxBufferSize) {
+        stream = file;
+        return true;
+    }
+
+
+    //buffer entire file into memory
+    char* filebuffer = new char[file_size+1];
+
+    if(!file->read(filebuffer, file_size)) {
+        file->close();
+        delete file;
+        delete [] filebuffer;
+        return false;
+    }
+    filebuffer[file_size] = '\0';
+
+    file->close();
+    delete file;
+
+    stream = new std::istringstream(std::string(filebuffer));
+
+    delete[] filebuffer;
+
+    return true;
+}
+
+SeekLog::~SeekLog() {
+    if(stream!=0) delete stream;
+    if(decoder!=0) delete decoder;
+    unmapFile();
+}
+
+float SeekLog::getPercent() {
+    return current_percent;
+}
+
+void SeekLog::setPointer(std::streampos pointer) {
+
+    if(indexed) {
+        current_line = std::lower_bound(line_index.begin(), line_index.end(), (long long) pointer) - line_index.begin();
+    }
+
+    if(decoder != 0) {
+        skipDecoded(pointer);
+        return;
+    }
+
+    if(memory_mapped) {
+        map_offset = std::min((long long) pointer, file_size);
+        return;
+    }
+
+    stream->clear();
+    stream->seekg(pointer);
+}
+
+std::streampos SeekLog::getPointer() {
+    if(memory_mapped) return (std::streampos) map_offset;
+
+    if(decoder != 0) return (std::streampos) (decoder->getOutputOffset() - (long long) (decode_end - decode_start));
+
+    return stream->tellg();
+}
+
+void SeekLog::seekTo(float percent) {
+
+    // with an index, seek proportionally by line rather than by byte
+    if(indexed) {
+        seekToLine((size_t) (percent * line_index.size()));
+        return;
+    }
+
+    if(decoder != 0) {
+        seekCompressed(percent);
+        return;
+    }
+
+    std::streampos mem_offset = (std::streampos) (percent * file_size);
+
+    if(memory_mapped) {
+        setPointer(mem_offset);
+
+        //throw away end of line
+        if(map_offset != 0) {
+            LogLine eol;
+            getNextLine(eol);
+        }
+        return;
+    }
+
+    setPointer(mem_offset);
+    
+    //throw away end of line
+    if(mem_offset != (std::streampos)0) {
+        std::string eol;
+        getNextLine(eol);
+    }
+}
+
+bool SeekLog::getNextLine(std::string& line) {
+
+    if(memory_mapped || decoder != 0) {
+        LogLine mapped_line;
+        if(!getNextLine(mapped_line)) return false;
+
+        line.assign(mapped_line.data, mapped_line.length);
+        return true;
+    }
+
+    //try and fix the stream
+    if(isFinished()) stream->clear();
+
+    std::getline(*stream, line);
+    
+    //remove carriage returns
+    if (line.size() > 0 && line[line.size()-1] == '\r') {
+        line.resize(line.size() - 1);
+    }
+
+    if(stream->fail()) {
+        return false;
+    }
+
+    current_percent = (float) stream->tellg() / file_size;
+    //debugLog("current_percent = %.2f\n", current_percent);
+
+    lineRead();
+
+    return true;
+}
+
+// returns a slice of the next line, either pointing directly into
+// the mapped file or into a buffer owned by the SeekLog.
+// the slice is only valid until the next read.
+bool SeekLog::getNextLine(LogLine& line) {
+
+    if(decoder != 0) return getNextDecodedLine(line);
+
+    if(!memory_mapped) {
+        if(!getNextLine(line_buffer)) return false;
+
+        line = LogLine(line_buffer.data(), line_buffer.size());
+        return true;
+    }
+
+    if(map_offset >= file_size) return false;
+
+    const char* start = map_data + map_offset;
+    size_t remaining  = (size_t) (file_size - map_offset);
+
+    const char* eol = (const char*) memchr(start, '\n', remaining);
+
+    size_t length = eol != 0 ? (size_t) (eol - start) : remaining;
+
+    map_offset += length;
+
+    //skip newline
+    if(eol != 0) map_offset++;
+
+    //remove carriage returns
+    if(length > 0 && start[length-1] == '\r') length--;
+
+    line = LogLine(start, length);
+
+    current_percent = (float) map_offset / file_size;
+
+    lineRead();
+
+    return true;
+}
+
+// memory mapped lines are returned as spans over the mapped file
+size_t SeekLog::getNextLines(LineBatch& batch, size_t max_lines) {
+
+    batch.clear();
+
+    if(memory_mapped) batch.setSource(map_data);
+
+    LogLine line;
+
+    while(batch.size() < max_lines && getNextLine(line)) {
+        if(memory_mapped) {
+            batch.addSpan(line.data - map_data, line.length);
+        } else {
+            batch.addLine(line.data, line.length);
+        }
+    }
+
+    return batch.size();
+}
+
+// temporarily move the file pointer to get a line somewhere else in the file
+bool SeekLog::getNextLineAt(std::string& line, float percent) {
+    std::streampos currpointer = getPointer();
+
+    seekTo(percent);
+
+    bool success = getNextLine(line);
+
+    //set the pointer back
+    setPointer(currpointer);
+    
+    return success;
+}
+
+bool SeekLog::getNextLineAt(LogLine& line, float percent) {
+    std::streampos currpointer = getPointer();
+
+    seekTo(percent);
+
+    bool success = getNextLine(line);
+
+    //set the pointer back
+    setPointer(currpointer);
+
+    return success;
+}
+
+void SeekLog::lineRead() {
+    if(!indexed) return;
+
+    current_line++;
+    current_percent = (float) current_line / line_index.size();
+}
+
+// Line Index
+
+struct SeekLogIndexHeader {
+    char magic[8];
+    long long file_size;
+    long long mtime;
+    long long line_count;
+    long long data_size;
+};
+
+static const char seeklog_index_magic[8] = { 'S', 'L', 'O', 'G', 'I', 'D', 'X', '2' };
+
+bool SeekLog::getModifiedTime(long long& mtime) {
+    struct stat st;
+
+    if(stat(logfile.c_str(), &st) != 0) return false;
+
+    mtime = (long long) st.st_mtime;
+
+    return true;
+}
+
+bool SeekLog::scanLineOffsets() {
+
+    line_index.clear();
+
+    long long data_size = file_size;
+
+    if(decoder != 0) {
+        if(!restartDecoder(0)) return false;
+
+        line_index.push_back(0);
+
+        std::vector<char> chunk(1048576);
+
+        long long offset = 0;
+
+        size_t bytes_read;
+
+        while((bytes_read = decoder->read(&(chunk[0]), chunk.size())) > 0) {
+            seeklog_scan_newlines(&(chunk[0]), bytes_read, offset, line_index);
+            offset += bytes_read;
+        }
+
+        decoded_size = data_size = offset;
+
+    } else if(file_size <= 0) {
+        return true;
+    } else if(memory_mapped) {
+        line_index.push_back(0);
+        seeklog_scan_newlines(map_data, (size_t) file_size, 0, line_index);
+    } else {
+        line_index.push_back(0);
+
+        std::ifstream file(logfile.c_str(), std::ios::in | std::ios::binary);
+
+        if(!file.is_open()) return false;
+
+        std::vector<char> chunk(1048576);
+
+        long long offset = 0;
+
+        while(offset < file_size) {
+            file.read(&(chunk[0]), chunk.size());
+
+            size_t bytes_read = (size_t) file.gcount();
+
+            if(bytes_read == 0) break;
+
+            seeklog_scan_newlines(&(chunk[0]), bytes_read, offset, line_index);
+
+            offset += bytes_read;
+        }
+
+        if(offset != file_size) return false;
+    }
+
+    //a trailing newline does not start a new line
+    if(!line_index.empty() && line_index.back() == data_size) line_index.pop_back();
+
+    return true;
+}
+
+bool SeekLog::readIndexCache(const std::string& index_file, long long mtime) {
+
+    std::ifstream in(index_file.c_str(), std::ios::in | std::ios::binary);
+
+    if(!in.is_open()) return false;
+
+    SeekLogIndexHeader header;
+
+    if(!in.read((char*) &header, sizeof(header))) return false;
+
+    if(   memcmp(header.magic, seeklog_index_magic, sizeof(seeklog_index_magic)) != 0
+       || header.file_size != file_size
+       || header.mtime != mtime
+       || header.line_count < 0
+       || header.data_size < 0) return false;
+
+    // an uncompressed log is its own data
+    if(decoder == 0 && header.data_size != file_size) return false;
+
+    // there cannot be more lines than bytes, or than offsets in the file
+    std::streampos offsets_start = in.tellg();
+    in.seekg(0, std::ios::end);
+    long long offsets_size = (long long) (in.tellg() - offsets_start);
+    in.seekg(offsets_start);
+
+    if(   header.line_count > header.data_size
+       || header.line_count * (long long) sizeof(long long) != offsets_size) return false;
+
+    line_index.resize((size_t) header.line_count);
+
+    if(header.line_count > 0 && !in.read((char*) &(line_index[0]), header.line_count * sizeof(long long))) {
+        line_index.clear();
+        return false;
+    }
+
+    // the offsets are used to read from the log directly, so discard
+    // a damaged or stale index rather than trusting it
+    long long data_size = decoder != 0 ? header.data_size : file_size;
+
+    bool valid = line_index.empty() ? data_size == 0 : line_index[0] == 0;
+
+    for(size_t i = 1; valid && i < line_index.size(); i++) {
+        if(line_index[i] <= line_index[i-1]) valid = false;
+    }
+
+    if(valid && !line_index.empty() && line_index.back() >= data_size) valid = false;
+
+    if(!valid) {
+        debugLog("discarding invalid line index %s", index_file.c_str());
+        line_index.clear();
+        return false;
+    }
+
+    if(decoder != 0) decoded_size = header.data_size;
+
+    return true;
+}
+
+void SeekLog::writeIndexCache(const std::string& index_file, long long mtime) {
+
+    std::ofstream out(index_file.c_str(), std::ios::out | std::ios::binary);
+
+    if(!out.is_open()) {
+        debugLog("could not write line index %s", index_file.c_str());
+        return;
+    }
+
+    SeekLogIndexHeader header;
+    memcpy(header.magic, seeklog_index_magic, sizeof(seeklog_index_magic));
+    header.file_size  = file_size;
+    header.mtime      = mtime;
+    header.line_count = line_index.size();
+    header.data_size  = decoder != 0 ? decoded_size : file_size;
+
+    out.write((const char*) &header, sizeof(header));
+
+    if(!line_index.empty()) {
+        out.write((const char*) &(line_index[0]), line_index.size() * sizeof(long long));
+    }
+}
+
+// build an index of line offsets so lines can be seeked to directly.
+// the index is cached in a '.idx' file next to the log, which is reused
+// while the size and modification time of the log are unchanged.
+
+bool SeekLog::buildIndex(bool use_cache) {
+
+    std::streampos pointer = getPointer();
+
+    long long mtime = 0;
+    bool have_mtime = use_cache && getModifiedTime(mtime);
+
+    std::string index_file = logfile + ".idx";
+
+    if(!(have_mtime && readIndexCache(index_file, mtime))) {
+
+        if(!scanLineOffsets()) {
+            line_index.clear();
+            if(decoder != 0) setPointer(pointer);
+            return false;
+        }
+
+        if(have_mtime) writeIndexCache(index_file, mtime);
+    }
+
+    indexed = true;
+
+    //find the line at the current position
+    if(pointer < (std::streampos) 0) pointer = (std::streampos) (decoder != 0 ? decoded_size : file_size);
+
+    setPointer(pointer);
+
+    return true;
+}
+
+size_t SeekLog::getLineCount() const {
+    return line_index.size();
+}
+
+size_t SeekLog::getLineNumber() const {
+    return current_line;
+}
+
+bool SeekLog::seekToLine(size_t line_number) {
+    if(!indexed) return false;
+
+    if(line_number >= line_index.size()) {
+        setPointer((std::streampos) (decoder != 0 ? decoded_size : file_size));
+        current_percent = 1.0f;
+        return false;
+    }
+
+    setPointer((std::streampos) line_index[line_number]);
+
+    current_percent = (float) line_number / line_index.size();
+
+    return true;
+}
+
+bool SeekLog::getLine(size_t line_number, LogLine& line) {
+    if(!indexed || line_number >= line_index.size()) return false;
+
+    if(!memory_mapped) {
+        if(!getLine(line_number, line_buffer)) return false;
+
+        line = LogLine(line_buffer.data(), line_buffer.size());
+        return true;
+    }
+
+    long long start = line_index[line_number];
+    long long end   = line_number+1 < line_index.size() ? line_index[line_number+1] : file_size;
+
+    const char* data = map_data + start;
+    size_t length    = (size_t) (end - start);
+
+    if(length > 0 && data[length-1] == '\n') length--;
+    if(length > 0 && data[length-1] == '\r') length--;
+
+    line = LogLine(data, length);
+
+    return true;
+}
+
+bool SeekLog::getLine(size_t line_number, std::string& line) {
+    if(!indexed || line_number >= line_index.size()) return false;
+
+    if(memory_mapped) {
+        LogLine mapped_line;
+        if(!getLine(line_number, mapped_line)) return false;
+
+        line.assign(mapped_line.data, mapped_line.length);
+        return true;
+    }
+
+    std::streampos currpointer = getPointer();
+    float currpercent = current_percent;
+
+    if(currpointer < (std::streampos) 0) currpointer = (std::streampos) (decoder != 0 ? decoded_size : file_size);
+
+    setPointer((std::streampos) line_index[line_number]);
+
+    bool success = getNextLine(line);
+
+    //set the pointer back
+    setPointer(currpointer);
+    current_percent = currpercent;
+
+    return success;
+}
+
+// Parallel Scan
+
+#define SEEKLOG_SCAN_CHUNK_SIZE 4194304
+
+class SeekLogScanJob {
+public:
+    SeekLogScanner* scanner;
+    const char* data;
+    std::vector<long long> boundaries;
+
+    SDL_mutex* mutex;
+    int next_chunk;
+
+    SeekLogScanJob() : scanner(0), data(0), next_chunk(0) {
+        mutex = SDL_CreateMutex();
+    };
+
+    ~SeekLogScanJob() {
+        SDL_DestroyMutex(mutex);
+    };
+
+    int nextChunk() {
+        SDL_mutexP(mutex);
+
+            int i = next_chunk++;
+
+        SDL_mutexV(mutex);
+
+        return i;
+    };
+};
+
+static int seeklog_scan_thread(void* arg) {
+    SeekLogScanJob* job = static_cast<SeekLogScanJob*>(arg);
+
+    int chunk_count = (int) job->boundaries.size() - 1;
+
+    int i;
+    while((i = job->nextChunk()) < chunk_count) {
+        long long start = job->boundaries[i];
+        job->scanner->scanChunk(i, job->data + start, (size_t) (job->boundaries[i+1] - start));
+    }
+
+    return 0;
+}
+
+// split the log into newline aligned chunks and scan them across
+// a pool of threads. compressed logs are scanned sequentially.
+// returns the number of chunks scanned
+
+int SeekLog::scanChunks(SeekLogScanner& scanner, int thread_count) {
+
+    if(decoder != 0) return scanSequential(scanner);
+
+    // map the file for the duration of the scan, leaving the stream as it is
+    if(!memory_mapped) {
+        long long stream_file_size = file_size;
+
+        if(!mapFile()) {
+            file_size = stream_file_size;
+            return scanSequential(scanner);
+        }
+
+        int chunks = scanChunks(scanner, thread_count);
+
+        unmapFile();
+        file_size = stream_file_size;
+
+        return chunks;
+    }
+
+    if(file_size <= 0) return 0;
+
+#if SDL_VERSION_ATLEAST(2,0,0)
+    if(thread_count <= 0) thread_count = SDL_GetCPUCount();
+#else
+    if(thread_count <= 0) thread_count = 1;
+#endif
+
+    // use several chunks per thread to balance the load
+    long long chunk_count = std::min((long long) thread_count * 4, file_size / SEEKLOG_SCAN_CHUNK_SIZE + 1);
+
+    SeekLogScanJob job;
+    job.scanner = &scanner;
+    job.data    = map_data;
+
+    job.boundaries.push_back(0);
+
+    for(long long i = 1; i < chunk_count; i++) {
+        long long offset = std::max(file_size * i / chunk_count, job.boundaries.back());
+
+        const char* eol = (const char*) memchr(map_data + offset, '\n', (size_t) (file_size - offset));
+
+        if(eol == 0) break;
+
+        offset = (eol - map_data) + 1;
+
+        if(offset > job.boundaries.back() && offset < file_size) job.boundaries.push_back(offset);
+    }
+
+    job.boundaries.push_back(file_size);
+
+    int chunks = (int) job.boundaries.size() - 1;
+
+    thread_count = std::min(thread_count, chunks);
+
+    std::vector<SDL_Thread*> threads;
+
+    for(int i = 1; i < thread_count; i++) {
+#if SDL_VERSION_ATLEAST(2,0,0)
+        SDL_Thread* thread = SDL_CreateThread( seeklog_scan_thread, "seeklog_scan", &job );
+#else
+        SDL_Thread* thread = SDL_CreateThread( seeklog_scan_thread, &job );
+#endif
+        if(thread != 0) threads.push_back(thread);
+    }
+
+    // this thread also takes part
+    seeklog_scan_thread(&job);
+
+    for(size_t i = 0; i < threads.size(); i++) {
+        SDL_WaitThread(threads[i], 0);
+    }
+
+    for(int i = 0; i < chunks; i++) {
+        scanner.mergeChunk(i);
+    }
+
+    return chunks;
+}
+
+int SeekLog::scanSequential(SeekLogScanner& scanner) {
+
+    int chunks = 0;
+
+    if(decoder != 0) {
+        // use a separate log so the position of this one is unaffected
+        SeekLog source(logfile);
+
+        source.decode_buffer.resize(SEEKLOG_SCAN_CHUNK_SIZE);
+
+        while(true) {
+            while(source.decode_end - source.decode_start < SEEKLOG_SCAN_CHUNK_SIZE && source.fillDecodeBuffer());
+
+            size_t available = source.decode_end - source.decode_start;
+
+            if(available == 0) break;
+
+            const char* start = &(source.decode_buffer[source.decode_start]);
+
+            size_t length = available;
+
+            // stop at the last complete line unless this is the end of the log
+            if(!source.decode_eof) {
+                const char* eol = start + available;
+                while(eol > start && eol[-1] != '\n') eol--;
+
+                if(eol > start) length = eol - start;
+            }
+
+            scanner.scanChunk(chunks, start, length);
+            scanner.mergeChunk(chunks);
+
+            source.decode_start += length;
+            chunks++;
+        }
+
+        return chunks;
+    }
+
+    if(stream == 0) return 0;
+
+    // scan from the start of the existing stream, then put it back where it was
+    bool finished = stream->fail() || stream->eof();
+
+    std::streampos position = finished ? std::streampos(0) : stream->tellg();
+
+    stream->clear();
+    stream->seekg(0, std::ios::beg);
+
+    std::vector<char> chunk(SEEKLOG_SCAN_CHUNK_SIZE);
+
+    size_t used = 0;
+
+    while(true) {
+        if(used == chunk.size()) chunk.resize(chunk.size() * 2);
+
+        stream->read(&(chunk[used]), chunk.size() - used);
+
+        size_t bytes_read = (size_t) stream->gcount();
+
+        used += bytes_read;
+
+        if(used == 0) break;
+
+        size_t length = used;
+
+        if(bytes_read > 0) {
+            while(length > 0 && chunk[length-1] != '\n') length--;
+
+            // line longer than the chunk, read more
+            if(length == 0) continue;
+        }
+
+        scanner.scanChunk(chunks, &(chunk[0]), length);
+        scanner.mergeChunk(chunks);
+        chunks++;
+
+        memmove(&(chunk[0]), &(chunk[length]), used - length);
+        used -= length;
+    }
+
+    stream->clear();
+
+    if(finished) {
+        stream->seekg(0, std::ios::end);
+        stream->setstate(std::ios::eofbit);
+    } else {
+        stream->seekg(position);
+    }
+
+    return chunks;
+}
+
+bool SeekLog::isFinished() {
+    if(memory_mapped) return map_offset >= file_size;
+
+    if(decoder != 0) return (decode_eof || decoder->isFinished()) && decode_start == decode_end;
+
+    bool finished = false;
+
+    if(stream->fail() || stream->eof()) {
+        //debugLog("stream is finished");
+        finished=true;
+    }
+
+    return finished;
+}
+
+// MergedLog
+
+MergedLog::MergedLog(MergedLogKey* key_extractor, size_t read_ahead)
+    : key_extractor(key_extractor), read_ahead(read_ahead) {
+    this->stream = 0;
+
+    if(this->read_ahead == 0) this->read_ahead = 1;
+}
+
+MergedLog::~MergedLog() {
+    for(size_t i = 0; i < sources.size(); i++) {
+        delete sources[i];
+    }
+}
+
+// the merged log takes ownership of the log
+void MergedLog::addLog(BaseLog* log, int idle_timeout) {
+
+    if(idle_timeout < 0) {
+        idle_timeout = dynamic_cast<StreamLog*>(log) != 0 ? 0 : MERGED_LOG_IDLE_TIMEOUT;
+    }
+
+    sources.push_back(new MergedLogSource(log, (Uint32) idle_timeout));
+    empty_sources.push_back(sources.size()-1);
+}
+
+// true if a should come after b. ties are broken by the order the logs were added
+bool MergedLog::heapCompare(int a, int b) const {
+    long long key_a = sources[a]->keys.front();
+    long long key_b = sources[b]->keys.front();
+
+    if(key_a != key_b) return key_a > key_b;
+
+    return a > b;
+}
+
+void MergedLog::pushHeap(int source_index) {
+
+    heap.push_back(source_index);
+
+    size_t i = heap.size() - 1;
+
+    while(i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if(!heapCompare(heap[parent], heap[i])) break;
+
+        std::swap(heap[parent], heap[i]);
+        i = parent;
+    }
+}
+
+int MergedLog::popHeap() {
+
+    int top = heap[0];
+
+    heap[0] = heap.back();
+    heap.pop_back();
+
+    size_t i = 0;
+
+    while(true) {
+        size_t left     = i * 2 + 1;
+        size_t right    = left + 1;
+        size_t smallest = i;
+
+        if(left  < heap.size() && heapCompare(heap[smallest], heap[left]))  smallest = left;
+        if(right < heap.size() && heapCompare(heap[smallest], heap[right])) smallest = right;
+
+        if(smallest == i) break;
+
+        std::swap(heap[smallest], heap[i]);
+        i = smallest;
+    }
+
+    return top;
+}
+
+// read ahead lines from a source, returns true if any lines are buffered
+bool MergedLog::fill(int source_index) {
+
+    MergedLogSource* source = sources[source_index];
+
+    std::string line;
+
+    while(source->lines.size() < read_ahead && source->log->getNextLine(line)) {
+
+        long long key;
+
+        // lines without a key stay with the previous line
+        if(!key_extractor->getKey(line, key)) key = source->last_key;
+
+        source->last_key = key;
+
+        source->lines.push_back(std::string());
+        source->lines.back().swap(line);
+        source->keys.push_back(key);
+    }
+
+    return !source->lines.empty();
+}
+
+bool MergedLog::getNextLine(std::string& line) {
+
+    bool waiting = false;
+
+    Uint32 now = SDL_GetTicks();
+
+    for(size_t i = 0; i < empty_sources.size();) {
+        int source_index = empty_sources[i];
+
+        MergedLogSource* source = sources[source_index];
+
+        if(fill(source_index)) {
+            source->idle = false;
+
+            pushHeap(source_index);
+            empty_sources[i] = empty_sources.back();
+            empty_sources.pop_back();
+            continue;
+        }
+
+        // an unfinished source may still have an earlier line to come, so
+        // wait for it a while before merging the lines of the other sources
+        if(!source->log->isFinished()) {
+            if(!source->idle) {
+                source->idle       = true;
+                source->idle_since = now;
+            }
+
+            if(now - source->idle_since < source->idle_timeout) waiting = true;
+        }
+
+        i++;
+    }
+
+    if(waiting || heap.empty()) return false;
+
+    int source_index = popHeap();
+
+    MergedLogSource* source = sources[source_index];
+
+    line.swap(source->lines.front());
+
+    source->lines.pop_front();
+    source->keys.pop_front();
+
+    if(!source->lines.empty()) {
+        pushHeap(source_index);
+    } else {
+        empty_sources.push_back(source_index);
+    }
+
+    return true;
+}
+
+// discard the lines read ahead from the logs that are repositioned by a
+// seek. lines from other logs cannot be read again, so they are kept
+
+void MergedLog::resetBuffers() {
+
+    heap.clear();
+    empty_sources.clear();
+
+    for(size_t i = 0; i < sources.size(); i++) {
+        MergedLogSource* source = sources[i];
+
+        if(dynamic_cast<SeekLog*>(source->log) != 0) {
+            source->lines.clear();
+            source->keys.clear();
+            source->idle = false;
+        }
+
+        if(source->lines.empty()) {
+            empty_sources.push_back(i);
+        } else {
+            pushHeap(i);
+        }
+    }
+}
+
+// seek each seekable log to the same percentage
+void MergedLog::seekTo(float percent) {
+
+    for(size_t i = 0; i < sources.size(); i++) {
+        SeekLog* seeklog = dynamic_cast<SeekLog*>(sources[i]->log);
+
+        if(seeklog != 0) seeklog->seekTo(percent);
+    }
+
+    resetBuffers();
+}
+
+// position each seekable log at its first line with a key of at least the specified key
+void MergedLog::seekToKey(long long key) {
+
+    resetBuffers();
+
+    std::string line;
+
+    for(size_t i = 0; i < sources.size(); i++) {
+
+        MergedLogSource* source = sources[i];
+
+        SeekLog* seeklog = dynamic_cast<SeekLog*>(source->log);
+
+        if(seeklog == 0) continue;
+
+        // binary search for the last position before the key
+        float lower = 0.0f;
+        float upper = 1.0f;
+
+        for(int j = 0; j < 20; j++) {
+            float middle = (lower + upper) * 0.5f;
+
+            long long line_key;
+
+            if(seeklog->getNextLineAt(line, middle) && key_extractor->getKey(line, line_key) && line_key < key) {
+                lower = middle;
+            } else {
+                upper = middle;
+            }
+        }
+
+        seeklog->seekTo(lower);
+
+        // skip forward to the first line with the key
+        while(seeklog->getNextLine(line)) {
+            long long line_key;
+
+            if(!key_extractor->getKey(line, line_key) || line_key < key) continue;
+
+            source->last_key = line_key;
+
+            source->lines.push_back(line);
+            source->keys.push_back(line_key);
+            break;
+        }
+    }
+}
+
+float MergedLog::getPercent() {
+
+    float percent = 0.0f;
+    int seekable  = 0;
+
+    for(size_t i = 0; i < sources.size(); i++) {
+        SeekLog* seeklog = dynamic_cast<SeekLog*>(sources[i]->log);
+
+        if(seeklog == 0) continue;
+
+        percent += seeklog->getPercent();
+        seekable++;
+    }
+
+    return seekable > 0 ? percent / seekable : 0.0f;
+}
+
+bool MergedLog::isFinished() {
+
+    if(!heap.empty()) return false;
+
+    for(size_t i = 0; i < sources.size(); i++) {
+        if(!sources[i]->lines.empty() || !sources[i]->log->isFinished()) return false;
+    }
+
+    return true;
 }
@@ -31,10 +31,86 @@
 #include "display.h"
 #include "logger.h"
 
+#include "SDL_thread.h"
+
 #include <sstream>
 #include <iostream>
 #include <fstream>
 #include <fcntl.h>
+#include <vector>
+#include <deque>
+#include <cstring>
+#include <algorithm>
+
+// a slice of a line owned by the log (valid until the next read)
+
+class LogLine {
+public:
+    const char* data;
+    size_t length;
+
+    LogLine() : data(0), length(0) {};
+    LogLine(const char* data, size_t length) : data(data), length(length) {};
+
+    bool empty() const { return length == 0; };
+    std::string str() const { return std::string(data, length); };
+};
+
+// a batch of lines stored as spans over either a reused arena or
+// memory owned by the log (valid until the next read)
+
+class LineSpan {
+public:
+    size_t offset;
+    size_t length;
+
+    LineSpan() : offset(0), length(0) {};
+    LineSpan(size_t offset, size_t length) : offset(offset), length(length) {};
+};
+
+class LineBatch {
+    std::vector<char> arena;
+    size_t arena_used;
+
+    const char* source;
+
+    std::vector<LineSpan> spans;
+public:
+    LineBatch() : arena_used(0), source(0) {};
+
+    void clear() {
+        spans.clear();
+        arena_used = 0;
+        source = 0;
+    };
+
+    size_t size() const { return spans.size(); };
+    bool empty() const { return spans.empty(); };
+
+    const char* data() const { return source != 0 ? source : (arena.empty() ? 0 : &(arena[0])); };
+
+    LogLine operator[](size_t i) const {
+        return LogLine(data() + spans[i].offset, spans[i].length);
+    };
+
+    // copy a line into the arena
+    void addLine(const char* line, size_t length) {
+        if(arena_used + length > arena.size()) {
+            arena.resize(std::max(arena.size() * 2, arena_used + length));
+        }
+        if(length > 0) memcpy(&(arena[arena_used]), line, length);
+
+        spans.push_back(LineSpan(arena_used, length));
+        arena_used += length;
+    };
+
+    // reference lines in memory owned by the log instead of copying them
+    void setSource(const char* source) { this->source = source; };
+
+    void addSpan(size_t offset, size_t length) {
+        spans.push_back(LineSpan(offset, length));
+    };
+};
 
 class BaseLog {
 
@@ -43,20 +119,56 @@ protected:
 public:
     virtual ~BaseLog() {};
     virtual bool getNextLine(std::string& line) { return false; };
+    virtual size_t getNextLines(LineBatch& batch, size_t max_lines);
     virtual bool isFinished() { return false; };
 };
 
+// the threaded reader needs the atomics of SDL 2, and select() which
+// does not work on console handles on windows
+#if SDL_VERSION_ATLEAST(2,0,0) && !defined(_WIN32)
+#define STREAM_LOG_THREADED
+#endif
+
+enum stream_log_reader_state { STREAM_LOG_READER_RUNNING, STREAM_LOG_READER_EOF, STREAM_LOG_READER_EXIT };
+
 class StreamLog : public BaseLog {
 
     bool fcntl_fail;
 #ifdef _WIN32
     void* stdin_handle;
 #endif
+
+    int max_lines_per_frame;
+    int frame_line_count;
+
+    // threaded mode: a reader thread fills a single producer,
+    // single consumer ring of complete lines from stdin.
+    // otherwise the unthreaded mode is used
+    bool threaded;
+
+#ifdef STREAM_LOG_THREADED
+    std::vector<std::string> line_ring;
+    unsigned int ring_mask;
+
+    SDL_atomic_t ring_head;
+    SDL_atomic_t ring_tail;
+    SDL_atomic_t reader_state;
+
+    SDL_Thread* reader_thread;
+
+    static int startReader(void* log);
+    void readLines();
+    bool pushLine(std::string& line);
+    bool popLine(std::string& line);
+#endif
 public:
-    StreamLog();
+    StreamLog(bool threaded = false);
     ~StreamLog();
 
+    void setMaxLinesPerFrame(int max_lines);
+
     bool getNextLine(std::string& line);
+    size_t getNextLines(LineBatch& batch, size_t max_lines);
     bool isFinished();
 };
 
@@ -70,6 +182,21 @@ public:
     virtual const char* what() const throw() { return filename.c_str(); }
 };
 
+// scans a log in newline aligned chunks, possibly in parallel
+
+class SeekLogScanner {
+public:
+    virtual ~SeekLogScanner() {};
+
+    // may be called concurrently from worker threads
+    virtual void scanChunk(int chunk_index, const char* data, size_t length) = 0;
+
+    // called on the scanning thread in chunk order once all chunks are scanned
+    virtual void mergeChunk(int chunk_index) {};
+};
+
+class SeekLogDecoder;
+
 class SeekLog : public BaseLog {
 
     std::string logfile;
@@ -77,22 +204,153 @@ class SeekLog : public BaseLog {
     long long file_size;
     float current_percent;
 
+    bool memory_mapped;
+    const char* map_data;
+    long long map_offset;
+#ifdef _WIN32
+    void* map_file_handle;
+    void* map_handle;
+#else
+    int map_fd;
+#endif
+    std::string line_buffer;
+
+    // compressed logs are decompressed into decode_buffer on demand
+    SeekLogDecoder* decoder;
+    std::vector<char> decode_buffer;
+    size_t decode_start;
+    size_t decode_end;
+    bool decode_eof;
+    long long decoded_size;
+
+    // offset of the start of each line
+    std::vector<long long> line_index;
+    bool indexed;
+    size_t current_line;
+
     bool readFully();
+    bool mapFile();
+    void unmapFile();
+
+    bool openCompressed();
+    bool fillDecodeBuffer();
+    bool restartDecoder(size_t checkpoint_index);
+    bool skipDecoded(long long pointer);
+    bool seekCompressed(float percent);
+    bool getNextDecodedLine(LogLine& line);
+
+    int scanSequential(SeekLogScanner& scanner);
+
+    bool getModifiedTime(long long& mtime);
+    bool scanLineOffsets();
+    bool readIndexCache(const std::string& index_file, long long mtime);
+    void writeIndexCache(const std::string& index_file, long long mtime);
+
+    void lineRead();
 public:
-    SeekLog(std::string logfile);
+    SeekLog(std::string logfile, bool memory_map = false);
     ~SeekLog();
 
+    bool isMemoryMapped() const { return memory_mapped; };
+    bool isCompressed() const { return decoder != 0; };
+
     void setPointer(std::streampos pointer);
     std::streampos getPointer();
 
     void seekTo(float percent);
     bool getNextLine(std::string& line);
+    bool getNextLine(LogLine& line);
+    size_t getNextLines(LineBatch& batch, size_t max_lines);
     bool getNextLineAt(std::string& line, float percent);
+    bool getNextLineAt(LogLine& line, float percent);
     float getPercent();
 
+    bool buildIndex(bool use_cache = true);
+    bool hasIndex() const { return indexed; };
+
+    size_t getLineCount() const;
+    size_t getLineNumber() const;
+
+    bool seekToLine(size_t line_number);
+    bool getLine(size_t line_number, std::string& line);
+    bool getLine(size_t line_number, LogLine& line);
+
+    int scanChunks(SeekLogScanner& scanner, int thread_count = 0);
+
     bool isFinished();
 };
 
+// extracts the key that lines of a MergedLog are ordered by
+
+class MergedLogKey {
+public:
+    virtual ~MergedLogKey() {};
+
+    // return false if the line does not have a key
+    virtual bool getKey(const std::string& line, long long& key) = 0;
+};
+
+#define MERGED_LOG_IDLE_TIMEOUT 100
+
+class MergedLogSource {
+public:
+    BaseLog* log;
+    std::deque<std::string> lines;
+    std::deque<long long> keys;
+    long long last_key;
+
+    // when the source ran out of lines without being finished, and
+    // how long the other sources are held back waiting for it
+    bool idle;
+    Uint32 idle_since;
+    Uint32 idle_timeout;
+
+    MergedLogSource(BaseLog* log, Uint32 idle_timeout) : log(log), last_key(0), idle(false), idle_since(0), idle_timeout(idle_timeout) {};
+    ~MergedLogSource() { delete log; };
+};
+
+// merges several logs into one stream of lines ordered by key
+
+class MergedLog : public BaseLog {
+    std::vector<MergedLogSource*> sources;
+
+    // sources with buffered lines, ordered as a min-heap by next key
+    std::vector<int> heap;
+
+    // sources that need to be refilled
+    std::vector<int> empty_sources;
+
+    MergedLogKey* key_extractor;
+    size_t read_ahead;
+
+    bool heapCompare(int a, int b) const;
+    void pushHeap(int source_index);
+    int popHeap();
+
+    bool fill(int source_index);
+    void resetBuffers();
+public:
+    MergedLog(MergedLogKey* key_extractor, size_t read_ahead = 256);
+    ~MergedLog();
+
+    // each time an unfinished log runs out of lines the merge stalls for up
+    // to idle_timeout milliseconds, in case it has an earlier line to come.
+    // the default is 0 for a StreamLog, which drains after every burst of
+    // input, and MERGED_LOG_IDLE_TIMEOUT for other logs
+    void addLog(BaseLog* log, int idle_timeout = -1);
+
+    bool getNextLine(std::string& line);
+
+    void seekTo(float percent);
+    void seekToKey(long long key);
+    float getPercent();
+
+    bool isFinished();
+};
+
+void seeklog_scan_newlines(const char* data, size_t length, long long base_offset, std::vector<long long>& line_starts);
+
 extern long long gSeekLogMaxBufferSize;
+extern long long gSeekLogCheckpointSpan;
 
 #endif
@@ -344,6 +344,9 @@ void Shader::applyUniform(ShaderUniform* u) {
         case SHADER_UNIFORM_SAMPLER_3D:
             glUniform1i(location, ((Sampler3DShaderUniform*)u)->getValue());
             break;
+        case SHADER_UNIFORM_SAMPLER_2D_ARRAY:
+            glUniform1i(location, ((Sampler2DArrayShaderUniform*)u)->getValue());
+            break;
         case SHADER_UNIFORM_VEC2:
             glUniform2fv(location, 1, glm::value_ptr(((Vec2ShaderUniform*)u)->getValue()));
             break;
@@ -377,6 +377,31 @@ void Sampler3DShaderUniform::write(std::string& content) const {
     content.append(str(boost::format("uniform %s %s;\n") % type_name % name));
 }
 
+//Sampler2DArrayShaderUniform
+
+Sampler2DArrayShaderUniform::Sampler2DArrayShaderUniform(AbstractShader* shader, const std::string& name, int value) :
+    value(value), ShaderUniform(shader, name, SHADER_UNIFORM_SAMPLER_2D_ARRAY, "sampler2DArray") {
+}
+
+void Sampler2DArrayShaderUniform::setValue(int value) {
+    if(baked && this->value == value) return;
+
+    this->value = value;
+    modified = true;
+    initialized = true;
+}
+
+int& Sampler2DArrayShaderUniform::getValue() {
+    return value;
+}
+
+//cant be baked
+void Sampler2DArrayShaderUniform::setBaked(bool baked) {
+}
+
+void Sampler2DArrayShaderUniform::write(std::string& content) const {
+    content.append(str(boost::format("uniform %s %s;\n") % type_name % name));
+}
 
 //Vec2ShaderUniform
 
@@ -1022,6 +1047,8 @@ ShaderUniform* AbstractShaderPass::addUniform(const std::string& name, const std
             uniform = new Sampler2DShaderUniform(parent, name);
         } else if(type == "sampler3D") {
             uniform = new Sampler3DShaderUniform(parent, name);
+        } else if(type == "sampler2DArray") {
+            uniform = new Sampler2DArrayShaderUniform(parent, name);
         } else if(type == "vec2") {
             uniform = new Vec2ShaderUniform(parent, name);
         } else if(type == "vec3") {
@@ -1329,6 +1356,14 @@ void AbstractShader::setSampler3D (const std::string& name, int value) {
     ((Sampler3DShaderUniform*)uniform)->setValue(value);
 }
 
+void AbstractShader::setSampler2DArray (const std::string& name, int value) {
+    ShaderUniform* uniform = getUniform(name);
+
+    if(!uniform || uniform->getType() != SHADER_UNIFORM_SAMPLER_2D_ARRAY) return;
+
+    ((Sampler2DArrayShaderUniform*)uniform)->setValue(value);
+}
+
 void AbstractShader::setFloat(const std::string& name, float value) {
     ShaderUniform* uniform = getUniform(name);
 
@@ -19,6 +19,7 @@ enum { SHADER_UNIFORM_INT,
        SHADER_UNIFORM_SAMPLER_1D,
        SHADER_UNIFORM_SAMPLER_2D,
        SHADER_UNIFORM_SAMPLER_3D,
+       SHADER_UNIFORM_SAMPLER_2D_ARRAY,
        SHADER_UNIFORM_VEC2,
        SHADER_UNIFORM_VEC3,
        SHADER_UNIFORM_VEC4,
@@ -175,6 +176,20 @@ public:
     int& getValue();
 };
 
+class Sampler2DArrayShaderUniform : public ShaderUniform {
+    int value;
+public:
+    Sampler2DArrayShaderUniform(AbstractShader* shader, const std::string& name, int value = 0);
+
+    void write(std::string& content) const;
+
+    void setBaked(bool baked);
+
+    void setValue(int value);
+
+    int& getValue();
+};
+
 class Vec2ShaderUniform : public ShaderUniform {
     vec2 value;
 public:
@@ -469,6 +484,7 @@ public:
     void setSampler1D(const std::string& name, int value);
     void setSampler2D(const std::string& name, int value);
     void setSampler3D(const std::string& name, int value);
+    void setSampler2DArray(const std::string& name, int value);
     void setFloat(const std::string& name, float value);
     void setVec2 (const std::string& name, const vec2& value);
     void setVec3 (const std::string& name, const vec3& value);
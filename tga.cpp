@@ -28,7 +28,23 @@
 #include "tga.h"
 #include "display.h"
 
+#include "SDL.h"
+
 #include <iostream>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TGA_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// rows are split into more bands than threads so a band of detailed
+// rows doesn't hold up the rest of the frame
+#define TGA_BANDS_PER_THREAD 4
 
 TGAWriter::TGAWriter(int components)
     : components(components) {
@@ -37,43 +53,228 @@ TGAWriter::TGAWriter(int components)
 
     rle_count = 0;
     raw_count = 0;
+
+    thread_count = 1;
+}
+
+void TGAWriter::setThreads(int thread_count) {
+    this->thread_count = thread_count;
+}
+
+#ifdef TGA_SSE2
+static inline int tga_ctz(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// number of pixels from x that are the same as the pixel at x
+
+static int tga_run_length(const char* row, int x, int width, size_t components) {
+
+    const char* pixel = row + x * components;
+
+    int i = x + 1;
+
+    // most runs are short, check the first few pixels before setting up the compare
+    for(int short_end = std::min(width, x + 8); i < short_end; i++) {
+        if(memcmp(row + i * components, pixel, components) != 0) return i - x;
+    }
+
+#ifdef TGA_SSE2
+    // 48 bytes holds a whole number of 3 and 4 byte pixels
+    char pattern_bytes[48];
+
+    for(size_t j = 0; j < 48; j++) pattern_bytes[j] = pixel[j % components];
+
+    const __m128i pattern[3] = {
+        _mm_loadu_si128((const __m128i*) pattern_bytes),
+        _mm_loadu_si128((const __m128i*) (pattern_bytes + 16)),
+        _mm_loadu_si128((const __m128i*) (pattern_bytes + 32))
+    };
+
+    const char* start = row + i * components;
+    const char* end   = row + width * components;
+
+    size_t offset = 0;
+
+    for(int k = 0; start + offset + 16 <= end; k = (k + 1) % 3, offset += 16) {
+
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (start + offset));
+
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern[k])) ^ 0xffff;
+
+        if(mask != 0) {
+            return i + (offset + tga_ctz(mask)) / components - x;
+        }
+    }
+
+    i += offset / components;
+#endif
+
+    for(; i < width; i++) {
+        if(memcmp(row + i * components, pixel, components) != 0) break;
+    }
+
+    return i - x;
 }
 
-void TGAWriter::writeRLE(int pixel_count, const char* pixel) {
+// number of pixels from x before the start of the next run
+
+static int tga_raw_length(const char* row, int x, int width, size_t components) {
+
+    int i = x;
+
+#ifdef TGA_SSE2
+    // compare each pixel to the one after it, 5 or 4 pixels at a time
+    int step = 16 / components;
 
-    rle_count += pixel_count;
+    unsigned int select = components == 4 ? 0x1111 : 0x1249;
 
-    while(pixel_count > 0) {
-        int write_count = std::min(128, pixel_count);
+    for(; (i + 1) * components + 16 <= width * components; i += step) {
 
-        unsigned char counter_byte = (write_count-1) | 0x80;
-        out->write((char*)&counter_byte, 1);
-        out->write(pixel, components);
+        __m128i current = _mm_loadu_si128((const __m128i*) (row + i * components));
+        __m128i next    = _mm_loadu_si128((const __m128i*) (row + (i + 1) * components));
 
-        pixel_count -= write_count;
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(current, next));
+
+        // set where every byte of the pixel matched
+        unsigned int matched = mask & (mask >> 1) & (mask >> 2);
+        if(components == 4) matched &= (mask >> 3);
+
+        mask = matched & select;
+
+        if(mask != 0) {
+            return i + tga_ctz(mask) / components - x;
+        }
     }
+#endif
+
+    for(; i < width - 1; i++) {
+        if(memcmp(row + i * components, row + (i + 1) * components, components) == 0) return i - x;
+    }
+
+    return width - x;
 }
 
-void TGAWriter::writeRaw(std::vector<char>& buffer, int start, int pixel_count) {
+// run length encode a row, output must have room for width * (components + 1) bytes
+
+static char* tga_encode_row(const char* row, int width, size_t components, char* output, size_t& rle_count, size_t& raw_count) {
+
+    int x = 0;
+
+    while(x < width) {
+
+        int pixel_count = tga_run_length(row, x, width, components);
 
-    raw_count += pixel_count;
+        if(pixel_count > 1) {
 
-    int written = 0;
+            rle_count += pixel_count;
 
-    while(pixel_count > 0) {
-        int write_count = std::min(128, pixel_count);
+            const char* pixel = row + x * components;
 
-        char counter_byte = write_count-1;
+            while(pixel_count > 0) {
+                int write_count = std::min(128, pixel_count);
 
-        out->write((char*)&counter_byte, 1);
+                *output++ = (char) ((write_count-1) | 0x80);
+                memcpy(output, pixel, components);
+                output += components;
 
-        for(int i=0; i < write_count; i++) {
-            out->write(&(buffer[start+(i+written)*components]), components);
+                pixel_count -= write_count;
+                x += write_count;
+            }
+
+            continue;
         }
 
-        pixel_count -= write_count;
-        written += write_count;
+        pixel_count = tga_raw_length(row, x, width, components);
+
+        raw_count += pixel_count;
+
+        while(pixel_count > 0) {
+            int write_count = std::min(128, pixel_count);
+
+            *output++ = (char) (write_count-1);
+            memcpy(output, row + x * components, write_count * components);
+            output += write_count * components;
+
+            pixel_count -= write_count;
+            x += write_count;
+        }
     }
+
+    return output;
+}
+
+class TGAWriterBands {
+public:
+    const char* pixels;
+    size_t components;
+    int width;
+    int height;
+
+    int band_count;
+    int band_rows;
+
+    std::vector< std::vector<char> > encoded;
+    std::vector<size_t> rle_counts;
+    std::vector<size_t> raw_counts;
+
+    SDL_mutex* mutex;
+    int next_band;
+
+    TGAWriterBands() : next_band(0) {
+        mutex = SDL_CreateMutex();
+    };
+
+    ~TGAWriterBands() {
+        SDL_DestroyMutex(mutex);
+    };
+
+    int nextBand() {
+        SDL_mutexP(mutex);
+
+            int i = next_band++;
+
+        SDL_mutexV(mutex);
+
+        return i;
+    };
+};
+
+static void tga_encode_band(TGAWriterBands* bands, int band) {
+
+    int start = band * bands->band_rows;
+    int end   = std::min(bands->height, start + bands->band_rows);
+
+    size_t row_size = bands->width * bands->components;
+
+    std::vector<char>& output = bands->encoded[band];
+    output.resize((end - start) * bands->width * (bands->components + 1));
+
+    char* cursor = output.empty() ? 0 : &(output[0]);
+
+    for(int y = start; y < end; y++) {
+        cursor = tga_encode_row(bands->pixels + y * row_size, bands->width, bands->components, cursor, bands->rle_counts[band], bands->raw_counts[band]);
+    }
+
+    output.resize(output.empty() ? 0 : cursor - &(output[0]));
+}
+
+static int tga_encode_thread(void* arg) {
+    TGAWriterBands* bands = static_cast<TGAWriterBands*>(arg);
+
+    int i;
+    while((i = bands->nextBand()) < bands->band_count) {
+        tga_encode_band(bands, i);
+    }
+
+    return 0;
 }
 
 bool TGAWriter::open(const std::string& filename) {
@@ -110,7 +311,7 @@ void TGAWriter::screenshot(const std::string& filename) {
     close();
 }
 
-void TGAWriter::writeHeader() {
+void TGAWriter::encodeHeader(std::vector<char>& output) {
 
     char image_type = rle ? 10 : 2;
 
@@ -121,11 +322,11 @@ void TGAWriter::writeHeader() {
 
     char bpp = components * 8;
 
-    out->write(tga_header, 12);
-    out->write((char*)&width,  sizeof(short));
-    out->write((char*)&height, sizeof(short));
-    out->write(&bpp, 1);
-    out->write(&imagedescriptor, 1);
+    output.insert(output.end(), tga_header, tga_header + 12);
+    output.insert(output.end(), (char*)&width,  (char*)&width  + sizeof(short));
+    output.insert(output.end(), (char*)&height, (char*)&height + sizeof(short));
+    output.push_back(bpp);
+    output.push_back(imagedescriptor);
 }
 
 void TGAWriter::capture(std::vector<char>& buffer) {
@@ -134,93 +335,94 @@ void TGAWriter::capture(std::vector<char>& buffer) {
 }
 
 void TGAWriter::writeTGA(std::vector<char>& buffer) {
-    writeHeader();
-    writeScanlines(buffer, display.width, display.height);
-}
 
-void TGAWriter::writeScanlines(std::vector<char>& buffer, int width, int height) {
+    std::vector<char> output;
 
+    // uncompressed scanlines are written straight from the buffer
     if(!rle) {
-        out->write(&(buffer[0]), buffer.size());
-    } else {
-
-        for(int y=0; y<height; y++) {
+        encodeHeader(output);
+        write(output);
+        write(buffer);
+        return;
+    }
 
-            int match_count  = 0;
-            int last_written = -1;
+    encodeTGA(buffer, output);
+    write(output);
+}
 
-            char* last_pixel;
+void TGAWriter::encodeTGA(std::vector<char>& buffer, std::vector<char>& output) {
+    output.clear();
 
-            for(int x=0; x<width; x++) {
+    encodeHeader(output);
+    encodeScanlines(buffer, display.width, display.height, output);
+}
 
-                char* pixel = &(buffer[(x + y*width)*components]);
+void TGAWriter::write(const std::vector<char>& data) {
+    if(!data.empty()) out->write(&(data[0]), data.size());
+}
 
-                // nothing to compare to
-                if(x == 0) {
-                    last_pixel = pixel;
-                    continue;
-                }
+void TGAWriter::encodeScanlines(std::vector<char>& buffer, int width, int height, std::vector<char>& output) {
 
-                bool match =
-                    (components == 4) ?
-                        (pixel[0] == last_pixel[0] && pixel[1] == last_pixel[1] && pixel[2] == last_pixel[2] && pixel[3] == last_pixel[3])
-                      : (pixel[0] == last_pixel[0] && pixel[1] == last_pixel[1] && pixel[2] == last_pixel[2]);
+    if(!rle) {
+        output.insert(output.end(), buffer.begin(), buffer.end());
+        return;
+    }
 
-                if(match) {
+    if(height <= 0 || width <= 0) return;
 
-                    match_count++;
+    TGAWriterBands bands;
+    bands.pixels     = &(buffer[0]);
+    bands.components = components;
+    bands.width      = width;
+    bands.height     = height;
 
-                    // write any skipped pixels before the previous pixel
-                    if(match_count > 0) {
+    int threads = std::max(1, std::min(thread_count, height));
 
-                        int skipped = (x-(match_count)) - (last_written+1);
+    bands.band_count = threads > 1 ? std::min(height, threads * TGA_BANDS_PER_THREAD) : 1;
+    bands.band_rows  = (height + bands.band_count - 1) / bands.band_count;
+    bands.band_count = (height + bands.band_rows - 1) / bands.band_rows;
 
-                        if(skipped > 0) {
-                            writeRaw(buffer, (last_written + 1 + y*width)*components, skipped);
-                            last_written = x-1;
-                        }
-                    }
+    bands.encoded.resize(bands.band_count);
+    bands.rle_counts.resize(bands.band_count, 0);
+    bands.raw_counts.resize(bands.band_count, 0);
 
-                } else if(match_count > 0) {
+    std::vector<SDL_Thread*> encode_threads;
 
-                    writeRLE(match_count+1, last_pixel);
-                    last_written = x-1;
+    for(int i = 1; i < threads; i++) {
+#if SDL_VERSION_ATLEAST(2,0,0)
+        SDL_Thread* thread = SDL_CreateThread( tga_encode_thread, "tga_writer", &bands );
+#else
+        SDL_Thread* thread = SDL_CreateThread( tga_encode_thread, &bands );
+#endif
+        if(thread != 0) encode_threads.push_back(thread);
+    }
 
-                    match_count = 0;
-                }
+    // this thread also takes part
+    tga_encode_thread(&bands);
 
-                last_pixel = pixel;
-            }
+    for(size_t i = 0; i < encode_threads.size(); i++) {
+        SDL_WaitThread(encode_threads[i], 0);
+    }
 
-            if(match_count > 0) {
+    size_t encoded_size = 0;
 
-                writeRLE(match_count+1, last_pixel);
+    for(int i = 0; i < bands.band_count; i++) {
+        encoded_size += bands.encoded[i].size();
+    }
 
-            } else {
+    output.reserve(output.size() + encoded_size);
 
-                int skipped = width - (last_written+1);
+    for(int i = 0; i < bands.band_count; i++) {
+        output.insert(output.end(), bands.encoded[i].begin(), bands.encoded[i].end());
 
-                if(skipped > 0) {
-                    writeRaw(buffer, (last_written + 1 + y*width)*components, skipped);
-                }
-            }
-        }
+        rle_count += bands.rle_counts[i];
+        raw_count += bands.raw_counts[i];
     }
 }
 
 // TGAExporter
 
-TGAExporter::TGAExporter(const std::string& filename) {
-
-    buffer1.resize(display.width * display.height * 3);
-    buffer2.resize(display.width * display.height * 3);
-
-    buffer_shared_ptr = 0;
-
-    thread_state = TGA_EXPORTER_WAIT;
-
-    cond   = SDL_CreateCond();
-    mutex  = SDL_CreateMutex();
+TGAExporter::TGAExporter(const std::string& filename, int worker_count) {
 
     if(filename == "-") {
         writer.setOutputStream(&std::cout);
@@ -232,86 +434,52 @@ TGAExporter::TGAExporter(const std::string& filename) {
         }
     }
 
-#if SDL_VERSION_ATLEAST(2,0,0)
-    thread = SDL_CreateThread( TGAExporter::startThread, "tga_exporter", this );
-#else
-    thread = SDL_CreateThread( TGAExporter::startThread, this );
-#endif
+    queue  = new FrameQueue(this, display.width * display.height * 3, worker_count);
+    reader = new PixelReader(GL_BGR, 3);
 }
 
 TGAExporter::~TGAExporter() {
 
     stop();
 
-    SDL_DestroyCond(cond);
-    SDL_DestroyMutex(mutex);
-
-    buffer_shared_ptr = 0;
+    delete reader;
+    delete queue;
 
     if(!filename.empty()) {
         writer.close();
     }
 }
 
-int TGAExporter::startThread(void *exporter) {
-    (static_cast<TGAExporter*>(exporter))->run();
-    return 0;
-}
-
-void TGAExporter::run() {
-
-    SDL_mutexP(mutex);
-
-    while(thread_state != TGA_EXPORTER_EXIT) {
-
-        thread_state = TGA_EXPORTER_WAIT;
-
-        while (thread_state == TGA_EXPORTER_WAIT) {
-            SDL_CondWait(cond, mutex);
-        }
-
-        if (thread_state != TGA_EXPORTER_WRITE) break;
-
-        if (buffer_shared_ptr != 0) {
-            writer.writeTGA(*buffer_shared_ptr);
-        }
-    }
-
-    thread_state = TGA_EXPORTER_STOPPED;
-
-    SDL_mutexV(mutex);
-}
-
+// write any frames still being read back or encoded.
+// requires the GL context to still be current
 void TGAExporter::stop() {
-    if(!thread) return;
+    while(!reader->empty()) queueFrame();
 
-    if(thread_state == TGA_EXPORTER_STOPPED || thread_state == TGA_EXPORTER_EXIT) return;
-
-    SDL_mutexP(mutex);
+    queue->stop();
+}
 
-        thread_state = TGA_EXPORTER_EXIT;
+void TGAExporter::capture() {
 
-        SDL_CondSignal(cond);
+    reader->readPixels();
 
-    SDL_mutexV(mutex);
-   
-    SDL_WaitThread(thread, 0);
-    
-    thread = 0;
+    // frames are passed on once the oldest read has had time to complete
+    if(reader->full()) queueFrame();
 }
 
-void TGAExporter::capture() {
+void TGAExporter::queueFrame() {
 
-    std::vector<char>* next_pixel_ptr = (buffer_shared_ptr == &buffer1) ?
-        &buffer2 : &buffer1;
+    // waits if the encoders are too far behind
+    std::vector<char>& pixels = queue->beginFrame();
 
-    writer.capture(*next_pixel_ptr);
+    reader->getPixels(&(pixels[0]));
 
-    SDL_mutexP(mutex);
+    queue->endFrame();
+}
 
-        buffer_shared_ptr = next_pixel_ptr;
-        thread_state      = TGA_EXPORTER_WRITE;
+void TGAExporter::encodeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+    writer.encodeTGA(pixels, output);
+}
 
-    SDL_CondSignal(cond);
-    SDL_mutexV(mutex);
+void TGAExporter::writeFrame(std::vector<char>& pixels, std::vector<char>& output) {
+    writer.write(output);
 }
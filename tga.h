@@ -28,7 +28,8 @@
 #ifndef TGA_WRITER_H
 #define TGA_WRITER_H
 
-#include "SDL_thread.h"
+#include "frame_queue.h"
+#include "pixel_reader.h"
 
 #include <ostream>
 #include <fstream>
@@ -43,14 +44,12 @@ protected:
     size_t rle_count;
     size_t raw_count;
 
-    std::ostream* out;
-
-    void writeHeader();
+    int thread_count;
 
-    inline void writeRLE(int pixel_count, const char* pixel);
-    inline void writeRaw(std::vector<char>& buffer, int start, int pixel_count);
+    std::ostream* out;
 
-    void writeScanlines(std::vector<char>& buffer, int width, int height);
+    void encodeHeader(std::vector<char>& output);
+    void encodeScanlines(std::vector<char>& buffer, int width, int height, std::vector<char>& output);
 
     void init();
 
@@ -62,39 +61,40 @@ public:
 
     void setOutputStream(std::ostream* out);
 
+    // number of threads used to run length encode the scanlines of a frame
+    void setThreads(int thread_count);
+
     void screenshot(const std::string& filename);
     void capture(std::vector<char>& buffer);
     void writeTGA(std::vector<char>& buffer);
-};
 
-enum tga_exporter_state { TGA_EXPORTER_WAIT, TGA_EXPORTER_WRITE, TGA_EXPORTER_EXIT, TGA_EXPORTER_STOPPED };
+    // encode to memory, so frames can be encoded on other threads
+    void encodeTGA(std::vector<char>& buffer, std::vector<char>& output);
+    void write(const std::vector<char>& data);
+};
 
-class TGAExporter {
+class TGAExporter : public FrameEncoder {
 protected:
     TGAWriter writer;
 
-    std::vector<char>* buffer_shared_ptr;
-
-    std::vector<char> buffer1;
-    std::vector<char> buffer2;
-
-    SDL_cond*   cond;
-    SDL_mutex*  mutex;
-    SDL_Thread* thread;
-
-    int thread_state;
+    FrameQueue* queue;
+    PixelReader* reader;
 
     std::string filename;
 
-    static int startThread(void *exporter);
+    void queueFrame();
 public:
-    TGAExporter(const std::string& filename);
+    TGAExporter(const std::string& filename, int worker_count = 0);
     ~TGAExporter();
 
-    void run();
     void stop();
 
     void capture();
+
+    TGAWriter& getWriter() { return writer; };
+
+    void encodeFrame(std::vector<char>& pixels, std::vector<char>& output);
+    void writeFrame(std::vector<char>& pixels, std::vector<char>& output);
 };
 
 class TGAExporterException : public std::exception {
@@ -26,27 +26,394 @@
 */
 
 #include "vbo.h"
+#include "shader.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUADBUF_SSE2
+#include <emmintrin.h>
+#endif
+
+// the ring holds this many uploads before wrapping
+#define VBO_STREAM_FRAMES 3
+#define VBO_STREAM_MIN_SIZE 1048576
+#define VBO_STREAM_ALIGNMENT 64
+
+//VBO
+
+void VBO::setStreaming(bool streaming) {
+    if(this->streaming == streaming) return;
+
+    unload();
+
+    this->streaming = streaming;
+}
+
+void VBO::releaseStream() {
+
+    for(std::deque<VBOStreamRange>::iterator it = stream_ranges.begin(); it != stream_ranges.end(); it++) {
+        if((*it).sync != 0) glDeleteSync((*it).sync);
+    }
+    stream_ranges.clear();
+
+    if(mapped != 0) {
+        bind();
+        glUnmapBuffer(buffer_type);
+        unbind();
+        mapped = 0;
+    }
+
+    stream_offset = 0;
+}
+
+void VBO::allocateStream(int size) {
+
+    int new_capacity = std::max(VBO_STREAM_MIN_SIZE, size * VBO_STREAM_FRAMES);
+
+    // buffer storage is immutable so a new buffer is needed to resize it
+    unload();
+
+    persistent = (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) && (GLEW_VERSION_3_2 || GLEW_ARB_sync);
+
+    bind();
+
+    if(persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+        glBufferStorage(buffer_type, new_capacity, 0, flags);
+        mapped = glMapBufferRange(buffer_type, 0, new_capacity, flags);
+
+        // fall back to orphaning
+        if(mapped == 0) {
+            persistent = false;
+            unload();
+            bind();
+        }
+    }
+
+    if(!persistent) {
+        glBufferData(buffer_type, new_capacity, 0, GL_STREAM_DRAW);
+    }
+
+    capacity = new_capacity;
+}
+
+// wait for the GPU to finish with ranges overlapping start to end.
+// ranges are queued in the order they were written to the ring, so
+// the oldest is always the next to be overwritten
+
+void VBO::waitStream(int start, int end) {
+
+    while(!stream_ranges.empty()) {
+        VBOStreamRange& range = stream_ranges.front();
+
+        if(range.end <= start || range.start >= end) break;
+
+        // never fenced means it was never drawn
+        if(range.sync != 0) {
+            while(glClientWaitSync(range.sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+            }
+
+            glDeleteSync(range.sync);
+        }
+
+        stream_ranges.pop_front();
+    }
+}
+
+GLintptr VBO::stream(int size, const GLvoid* data) {
+
+    if(size * VBO_STREAM_FRAMES > capacity) allocateStream(size);
+
+    int offset = (stream_offset + VBO_STREAM_ALIGNMENT - 1) & ~(VBO_STREAM_ALIGNMENT - 1);
+
+    if(offset + size > capacity) {
+
+        if(persistent) {
+            // the end of the ring is being skipped
+            waitStream(offset, capacity);
+        } else {
+            // orphan the buffer, the driver keeps the old storage
+            // until draws using it are finished
+            bind();
+            glBufferData(buffer_type, capacity, 0, GL_STREAM_DRAW);
+            unbind();
+        }
+
+        offset = 0;
+    }
+
+    stream_offset = offset + size;
+
+    if(persistent) {
+        waitStream(offset, offset + size);
+
+        memcpy((char*)mapped + offset, data, size);
+
+        stream_ranges.push_back(VBOStreamRange(offset, offset + size));
+
+        return offset;
+    }
+
+    // nothing has used this part of the buffer since it was orphaned
+    bind();
+
+    GLvoid* dest = 0;
+
+    if(GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range) {
+        dest = glMapBufferRange(buffer_type, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+
+    if(dest != 0) {
+        memcpy(dest, data, size);
+        glUnmapBuffer(buffer_type);
+    } else {
+        glBufferSubData(buffer_type, offset, size, data);
+    }
+
+    unbind();
+
+    return offset;
+}
+
+void VBO::fence() {
+    if(!persistent || stream_ranges.empty()) return;
+
+    // the latest upload may be drawn more than once, so its fence is replaced
+    VBOStreamRange& latest = stream_ranges.back();
+
+    if(latest.sync != 0) glDeleteSync(latest.sync);
+
+    latest.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
 //quadbuf
 
+// expands each instance into a triangle strip. modulates the colour by
+// the bound texture like the fixed function path, including GL_ALPHA
+// textures which only affect the alpha
+
+// dirty retained slots closer together than this are uploaded together
+#define QUADBUF_RETAINED_GAP 64
+
+#define QUADBUF_TEXTURE_NONE  0
+#define QUADBUF_TEXTURE_RGBA  1
+#define QUADBUF_TEXTURE_ALPHA 2
+
+const char* quadbuf_instance_vertex_shader =
+    "#version 130\n"
+    "in vec4 quad_rect;\n"
+    "in vec4 quad_colour;\n"
+    "in vec4 quad_texcoord;\n"
+    "in float quad_layer;\n"
+    "out vec4 colour;\n"
+    "out vec3 texcoord;\n"
+    "void main() {\n"
+    "    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+    "    colour   = quad_colour;\n"
+    "    texcoord = vec3(mix(quad_texcoord.xy, quad_texcoord.zw, corner), quad_layer);\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(quad_rect.xy + quad_rect.zw * corner, 0.0, 1.0);\n"
+    "}\n";
+
+const char* quadbuf_instance_fragment_shader =
+    "#version 130\n"
+    "uniform sampler2D tex;\n"
+    "uniform sampler2DArray tex_array;\n"
+    "uniform int texture_mode;\n"
+    "uniform bool texture_array;\n"
+    "in vec4 colour;\n"
+    "in vec3 texcoord;\n"
+    "void main() {\n"
+    "    if(texture_mode != 0) {\n"
+    "        vec4 texel = texture_array ? texture(tex_array, texcoord) : texture(tex, texcoord.xy);\n"
+    "        gl_FragColor = texture_mode == 2 ? vec4(colour.rgb, colour.a * texel.a) : colour * texel;\n"
+    "    } else {\n"
+    "        gl_FragColor = colour;\n"
+    "    }\n"
+    "}\n";
+
+Shader* quadbuf_instance_shader = 0;
+
+// attribute locations for the current program
+GLuint quadbuf_instance_program = 0;
+GLint  quadbuf_instance_attribs[4];
+
+// texture arrays are bound to their own unit
+#define QUADBUF_TEXTURE_ARRAY_UNIT 1
+
+static Shader* quadbuf_grab_instance_shader() {
+
+    if(quadbuf_instance_shader != 0) return quadbuf_instance_shader;
+
+    Shader* shader = new Shader();
+    shader->setResourceName("quadbuf_instance");
+
+    try {
+        shader->includeSource(GL_VERTEX_SHADER,   quadbuf_instance_vertex_shader);
+        shader->includeSource(GL_FRAGMENT_SHADER, quadbuf_instance_fragment_shader);
+        shader->load();
+    } catch(ShaderException& exception) {
+        warnLog("quadbuf: could not load instance shader: %s", exception.what());
+        delete shader;
+        return 0;
+    }
+
+    // reloaded along with the other shaders if the context is lost
+    shadermanager.manage(shader);
+
+    quadbuf_instance_shader = shader;
+
+    return shader;
+}
+
+static int quadbuf_texture_mode(GLenum target) {
+
+    GLint format = 0;
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+
+    return (format == GL_ALPHA || format == GL_ALPHA8) ? QUADBUF_TEXTURE_ALPHA : QUADBUF_TEXTURE_RGBA;
+}
+
 quadbuf::quadbuf(int vertex_capacity) : vertex_capacity(vertex_capacity) {
-    vertex_count = 0;
+    vertex_count  = 0;
+    buffer_offset = 0;
+    vertex_format = QUADBUF_VERTEX_FULL;
+    sorted        = false;
+
+    retained       = false;
+    slots_dirty    = false;
+    textures_dirty = false;
 
     data = vertex_capacity > 0 ? new quadbuf_vertex[vertex_capacity] : 0;
+    compact_data  = 0;
+    instance_data = 0;
 
     //fprintf(stderr, "size of quadbuf_vertex = %d\n", sizeof(quadbuf_vertex));
 }
 
 quadbuf::~quadbuf() {
     if(data!=0) delete[] data;
+    if(compact_data!=0) delete[] compact_data;
+    if(instance_data!=0) delete[] instance_data;
 }
 
 void quadbuf::unload() {
     buf.unload();
 }
 
+void quadbuf::setStreaming(bool streaming) {
+    buf.setStreaming(streaming);
+    buffer_offset = 0;
+}
+
+void quadbuf::setVertexFormat(int vertex_format) {
+
+    if(vertex_format == QUADBUF_VERTEX_COMPACT && !(GLEW_VERSION_3_0 || GLEW_ARB_half_float_vertex)) {
+        vertex_format = QUADBUF_VERTEX_FULL;
+    }
+
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        bool supported = (GLEW_VERSION_3_3 || (GLEW_VERSION_3_0 && GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced));
+
+        if(!supported || quadbuf_grab_instance_shader() == 0) vertex_format = QUADBUF_VERTEX_FULL;
+    }
+
+    if(this->vertex_format == vertex_format) return;
+
+    this->vertex_format = vertex_format;
+
+    if(data != 0) delete[] data;
+    if(compact_data != 0) delete[] compact_data;
+    if(instance_data != 0) delete[] instance_data;
+
+    data = 0;
+    compact_data = 0;
+    instance_data = 0;
+
+    if(vertex_capacity > 0) {
+        if(vertex_format == QUADBUF_VERTEX_INSTANCED) instance_data = new quadbuf_instance[(vertex_capacity+3)/4];
+        else if(vertex_format == QUADBUF_VERTEX_COMPACT) compact_data = new quadbuf_compact_vertex[vertex_capacity];
+        else data = new quadbuf_vertex[vertex_capacity];
+    }
+
+    // buffer capacity is counted in vertices of the old size
+    buf.unload();
+    buffer_offset = 0;
+
+    reset();
+}
+
+void quadbuf::setSorted(bool sorted) {
+    this->sorted = sorted;
+}
+
+void quadbuf::setTextureLayer(GLuint textureid, GLuint array_textureid, int layer) {
+    texture_layers[textureid] = quadbuf_layer(array_textureid, layer);
+
+    relayerSlots(textureid, layer);
+}
+
+void quadbuf::clearTextureLayers() {
+
+    for(std::map<GLuint, quadbuf_layer>::iterator it = texture_layers.begin(); it != texture_layers.end(); it++) {
+        relayerSlots(it->first, 0);
+    }
+
+    texture_layers.clear();
+}
+
+// retained slots only have their layer set when written, so rewrite
+// the layer of slots already using the texture
+
+void quadbuf::relayerSlots(GLuint textureid, int layer) {
+
+    if(!retained || vertex_format != QUADBUF_VERTEX_INSTANCED) return;
+
+    int slot_count = vertex_count / 4;
+
+    for(int i = 0; i < slot_count; i++) {
+        if(slot_states[i] != QUADBUF_SLOT_VISIBLE || slot_textures[i] != textureid) continue;
+
+        instance_data[i].layer = layer;
+        slot_dirty[i] = true;
+
+        slots_dirty    = true;
+        textures_dirty = true;
+    }
+}
+
 void quadbuf::resize(int new_size) {
 
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        quadbuf_instance* _instance_data = instance_data;
+
+        instance_data = new quadbuf_instance[(new_size+3)/4];
+
+        if(_instance_data != 0) {
+            memcpy(instance_data, _instance_data, (vertex_capacity/4) * sizeof(quadbuf_instance));
+            delete[] _instance_data;
+        }
+
+        vertex_capacity = new_size;
+        return;
+    }
+
+    if(vertex_format == QUADBUF_VERTEX_COMPACT) {
+        quadbuf_compact_vertex* _compact_data = compact_data;
+
+        compact_data = new quadbuf_compact_vertex[new_size];
+
+        if(_compact_data != 0) {
+            memcpy(compact_data, _compact_data, vertex_capacity * sizeof(quadbuf_compact_vertex));
+            delete[] _compact_data;
+        }
+
+        vertex_capacity = new_size;
+        return;
+    }
+
     quadbuf_vertex* _data = data;
 
     data = new quadbuf_vertex[new_size];
@@ -63,6 +430,14 @@ void quadbuf::resize(int new_size) {
 void quadbuf::reset() {
     textures.resize(0);
     vertex_count = 0;
+
+    slot_states.clear();
+    slot_dirty.clear();
+    slot_textures.clear();
+    free_slots.clear();
+
+    slots_dirty    = false;
+    textures_dirty = false;
 }
 
 size_t quadbuf::vertices() {
@@ -77,19 +452,88 @@ size_t quadbuf::texture_changes() {
     return textures.size();
 }
 
-vec4 quadbuf_default_texcoord(0.0f, 0.0f, 1.0f, 1.0f);
+// convert 4 floats to half floats. values too small to be
+// normalized halfs are flushed to zero, texture coordinates don't need them
 
-void quadbuf::add(GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour) {
-    add(textureid, pos, dims, colour, quadbuf_default_texcoord);
+static inline void quadbuf_pack_half4(const float* values, GLushort* halfs) {
+
+#ifdef QUADBUF_SSE2
+    __m128i bits = _mm_castps_si128(_mm_loadu_ps(values));
+
+    __m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+    __m128i abs  = _mm_and_si128(bits, _mm_set1_epi32(0x7fffffff));
+
+    // rebias the exponent and round to nearest even
+    __m128i odd  = _mm_and_si128(_mm_srli_epi32(abs, 13), _mm_set1_epi32(1));
+    __m128i half = _mm_sub_epi32(abs, _mm_set1_epi32(0x38000000 - 0xfff));
+    half = _mm_srli_epi32(_mm_add_epi32(half, odd), 13);
+
+    __m128i too_small = _mm_cmplt_epi32(abs, _mm_set1_epi32(0x38800000));
+    __m128i too_large = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x477fefff));
+
+    half = _mm_andnot_si128(too_small, half);
+    half = _mm_or_si128(_mm_andnot_si128(too_large, half), _mm_and_si128(too_large, _mm_set1_epi32(0x7c00)));
+    half = _mm_or_si128(half, sign);
+
+    // pack as signed 16 bit values without saturating
+    half = _mm_sub_epi32(half, _mm_set1_epi32(0x8000));
+    half = _mm_add_epi16(_mm_packs_epi32(half, half), _mm_set1_epi16((short)0x8000));
+
+    _mm_storel_epi64((__m128i*) halfs, half);
+#else
+    for(int i=0;i<4;i++) {
+        unsigned int bits;
+        memcpy(&bits, &values[i], 4);
+
+        unsigned int sign = (bits >> 16) & 0x8000;
+        unsigned int abs  = bits & 0x7fffffff;
+
+        if(abs < 0x38800000)      halfs[i] = sign;
+        else if(abs > 0x477fefff) halfs[i] = sign | 0x7c00;
+        else                      halfs[i] = sign | ((abs - 0x38000000 + 0xfff + ((abs >> 13) & 1)) >> 13);
+    }
+#endif
 }
 
-void quadbuf::add(GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord) {
-    //debugLog("%d: %.2f, %.2f, %.2f, %.2f\n", i, pos.x, pos.y, dims.x, dims.y);
+static inline void quadbuf_pack_colour(const vec4& colour, GLubyte* packed) {
 
-    quadbuf_vertex v1(pos,                       colour, vec2(texcoord.x, texcoord.y));
-    quadbuf_vertex v2(pos + vec2(dims.x, 0.0f), colour, vec2(texcoord.z, texcoord.y));
-    quadbuf_vertex v3(pos + dims,                colour, vec2(texcoord.z, texcoord.w));
-    quadbuf_vertex v4(pos + vec2(0.0f, dims.y), colour, vec2(texcoord.x, texcoord.w));
+#ifdef QUADBUF_SSE2
+    __m128 c = _mm_loadu_ps(&colour.x);
+
+    c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+
+    __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f)));
+
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+
+    int value = _mm_cvtsi128_si32(i);
+    memcpy(packed, &value, 4);
+#else
+    for(int i=0;i<4;i++) {
+        packed[i] = (GLubyte) (std::min(1.0f, std::max(0.0f, colour[i])) * 255.0f + 0.5f);
+    }
+#endif
+}
+
+static inline void quadbuf_pack_vertex(const quadbuf_vertex& v, quadbuf_compact_vertex& packed) {
+
+    packed.pos = v.pos;
+
+    quadbuf_pack_colour(v.colour, packed.colour);
+
+    float texcoord[4] = { v.texcoord.x, v.texcoord.y, 0.0f, 0.0f };
+    GLushort halfs[4];
+
+    quadbuf_pack_half4(texcoord, halfs);
+
+    packed.texcoord[0] = halfs[0];
+    packed.texcoord[1] = halfs[1];
+}
+
+// make room for a quad and return the index of its first vertex
+
+int quadbuf::addQuad(GLuint textureid) {
 
     int i = vertex_count;
 
@@ -99,55 +543,579 @@ void quadbuf::add(GLuint textureid, const vec2& pos, const vec2& dims, const vec
         resize(vertex_count*2);
     }
 
-    data[i]   = v1;
-    data[i+1] = v2;
-    data[i+2] = v3;
-    data[i+3] = v4;
-
     if(textureid>0 && (textures.empty() || textures.back().textureid != textureid)) {
         textures.push_back(quadbuf_tex(i, textureid));
     }
+
+    return i;
+}
+
+vec4 quadbuf_default_texcoord(0.0f, 0.0f, 1.0f, 1.0f);
+
+void quadbuf::add(GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour) {
+    add(textureid, pos, dims, colour, quadbuf_default_texcoord);
+}
+
+void quadbuf::add(GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord) {
+    //debugLog("%d: %.2f, %.2f, %.2f, %.2f\n", i, pos.x, pos.y, dims.x, dims.y);
+
+    int i = addQuad(textureid);
+
+    writeQuad(i, textureid, pos, dims, colour, texcoord);
+}
+
+void quadbuf::writeQuad(int i, GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord) {
+
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        quadbuf_instance& instance = instance_data[i/4];
+
+        instance.pos  = pos;
+        instance.dims = dims;
+
+        quadbuf_pack_colour(colour, instance.colour);
+        quadbuf_pack_half4(&texcoord.x, instance.texcoord);
+
+        // retained quads are given their layer here
+        instance.layer = 0;
+
+        if(retained && !texture_layers.empty()) {
+            std::map<GLuint, quadbuf_layer>::iterator it = texture_layers.find(textureid);
+            if(it != texture_layers.end()) instance.layer = it->second.layer;
+        }
+
+        return;
+    }
+
+    if(vertex_format == QUADBUF_VERTEX_COMPACT) {
+
+        quadbuf_compact_vertex* v = &(compact_data[i]);
+
+        // the colour and texture coordinates are packed once for the quad
+        GLubyte packed_colour[4];
+        quadbuf_pack_colour(colour, packed_colour);
+
+        GLushort tc[4];
+        quadbuf_pack_half4(&texcoord.x, tc);
+
+        v[0].pos = pos;
+        v[1].pos = pos + vec2(dims.x, 0.0f);
+        v[2].pos = pos + dims;
+        v[3].pos = pos + vec2(0.0f, dims.y);
+
+        for(int j=0;j<4;j++) memcpy(v[j].colour, packed_colour, 4);
+
+        v[0].texcoord[0] = tc[0]; v[0].texcoord[1] = tc[1];
+        v[1].texcoord[0] = tc[2]; v[1].texcoord[1] = tc[1];
+        v[2].texcoord[0] = tc[2]; v[2].texcoord[1] = tc[3];
+        v[3].texcoord[0] = tc[0]; v[3].texcoord[1] = tc[3];
+
+        return;
+    }
+
+    data[i]   = quadbuf_vertex(pos,                       colour, vec2(texcoord.x, texcoord.y));
+    data[i+1] = quadbuf_vertex(pos + vec2(dims.x, 0.0f), colour, vec2(texcoord.z, texcoord.y));
+    data[i+2] = quadbuf_vertex(pos + dims,                colour, vec2(texcoord.z, texcoord.w));
+    data[i+3] = quadbuf_vertex(pos + vec2(0.0f, dims.y), colour, vec2(texcoord.x, texcoord.w));
 }
 
 void quadbuf::add(GLuint textureid, const quadbuf_vertex& v1, const quadbuf_vertex& v2, const quadbuf_vertex& v3, const quadbuf_vertex& v4) {
 
-    int i = vertex_count;
+    int i = addQuad(textureid);
 
-    vertex_count += 4;
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        quadbuf_instance& instance = instance_data[i/4];
 
-    if(vertex_count > vertex_capacity) {
-        resize(vertex_count*2);
+        instance.pos  = v1.pos;
+        instance.dims = v3.pos - v1.pos;
+
+        quadbuf_pack_colour(v1.colour, instance.colour);
+
+        float texcoord[4] = { v1.texcoord.x, v1.texcoord.y, v3.texcoord.x, v3.texcoord.y };
+        quadbuf_pack_half4(texcoord, instance.texcoord);
+
+        instance.layer = 0;
+
+        return;
+    }
+
+    if(vertex_format == QUADBUF_VERTEX_COMPACT) {
+        quadbuf_pack_vertex(v1, compact_data[i]);
+        quadbuf_pack_vertex(v2, compact_data[i+1]);
+        quadbuf_pack_vertex(v3, compact_data[i+2]);
+        quadbuf_pack_vertex(v4, compact_data[i+3]);
+        return;
     }
 
     data[i]   = v1;
     data[i+1] = v2;
     data[i+2] = v3;
     data[i+3] = v4;
+}
 
-    if(textureid>0 && (textures.empty() || textures.back().textureid != textureid)) {
-        textures.push_back(quadbuf_tex(i, textureid));
+// point quads using textures copied into texture arrays at their layer
+
+void quadbuf::applyTextureLayers() {
+
+    if(vertex_format != QUADBUF_VERTEX_INSTANCED || texture_layers.empty()) return;
+
+    for(size_t i = 0; i < textures.size(); i++) {
+        quadbuf_tex& tex = textures[i];
+
+        if(tex.target != GL_TEXTURE_2D) continue;
+
+        std::map<GLuint, quadbuf_layer>::iterator it = texture_layers.find(tex.textureid);
+
+        if(it == texture_layers.end()) continue;
+
+        int start = tex.start_index / 4;
+        int end   = (i+1 < textures.size() ? textures[i+1].start_index : vertex_count) / 4;
+
+        for(int j = start; j < end; j++) {
+            instance_data[j].layer = it->second.layer;
+        }
+
+        tex.textureid = it->second.array_textureid;
+        tex.target    = GL_TEXTURE_2D_ARRAY;
+    }
+}
+
+// join neighbouring ranges that now use the same texture
+
+void quadbuf::mergeTextures() {
+
+    if(textures.size() < 2) return;
+
+    size_t merged = 0;
+
+    for(size_t i = 1; i < textures.size(); i++) {
+        if(textures[i].textureid == textures[merged].textureid && textures[i].target == textures[merged].target) continue;
+
+        textures[++merged] = textures[i];
+    }
+
+    textures.resize(merged+1);
+}
+
+// stable bucket sort of the quads by texture, buckets are ordered by the
+// first use of each texture. ranges are contiguous so are moved whole
+
+void quadbuf::sortTextures() {
+
+    if(textures.size() < 2) return;
+
+    char* quads;
+    size_t quad_size;
+
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        quads     = (char*) instance_data;
+        quad_size = sizeof(quadbuf_instance);
+    } else if(vertex_format == QUADBUF_VERTEX_COMPACT) {
+        quads     = (char*) compact_data;
+        quad_size = sizeof(quadbuf_compact_vertex) * 4;
+    } else {
+        quads     = (char*) data;
+        quad_size = sizeof(quadbuf_vertex) * 4;
+    }
+
+    std::vector<quadbuf_tex> buckets;
+    std::vector<int> range_bucket(textures.size());
+    std::vector<int> bucket_size;
+
+    for(size_t i = 0; i < textures.size(); i++) {
+        quadbuf_tex& tex = textures[i];
+
+        int end = i+1 < textures.size() ? textures[i+1].start_index : vertex_count;
+
+        size_t b = 0;
+        while(b < buckets.size() && !(buckets[b].textureid == tex.textureid && buckets[b].target == tex.target)) b++;
+
+        if(b == buckets.size()) {
+            buckets.push_back(quadbuf_tex(0, tex.textureid, tex.target));
+            bucket_size.push_back(0);
+        }
+
+        range_bucket[i] = b;
+        bucket_size[b] += (end - tex.start_index) / 4;
+    }
+
+    if(buckets.size() == textures.size()) return;
+
+    // quads before the first texture are left in place
+    int position = textures.front().start_index / 4;
+
+    std::vector<int> bucket_position(buckets.size());
+
+    for(size_t b = 0; b < buckets.size(); b++) {
+        bucket_position[b] = position;
+        buckets[b].start_index = position * 4;
+        position += bucket_size[b];
+    }
+
+    sort_buffer.resize(vertex_count / 4 * quad_size);
+
+    for(size_t i = 0; i < textures.size(); i++) {
+        int start = textures[i].start_index / 4;
+        int end   = (i+1 < textures.size() ? textures[i+1].start_index : vertex_count) / 4;
+
+        int& dest = bucket_position[range_bucket[i]];
+
+        memcpy(&(sort_buffer[dest * quad_size]), quads + start * quad_size, (end - start) * quad_size);
+
+        dest += end - start;
+    }
+
+    int first = textures.front().start_index / 4;
+
+    memcpy(quads + first * quad_size, &(sort_buffer[first * quad_size]), (vertex_count / 4 - first) * quad_size);
+
+    textures = buckets;
+}
+
+// retained quads
+
+void quadbuf::setRetained(bool retained) {
+    if(this->retained == retained) return;
+
+    this->retained = retained;
+
+    // slots are uploaded in place
+    if(retained) setStreaming(false);
+
+    buf.unload();
+    reset();
+}
+
+void quadbuf::setSlot(int slot, int state, GLuint textureid) {
+
+    if(slot_states[slot] != state || slot_textures[slot] != textureid) textures_dirty = true;
+
+    slot_states[slot]   = state;
+    slot_textures[slot] = textureid;
+    slot_dirty[slot]    = true;
+
+    slots_dirty = true;
+}
+
+int quadbuf::allocate(GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord) {
+
+    int slot;
+
+    if(!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        slot = vertex_count / 4;
+
+        vertex_count += 4;
+
+        if(vertex_count > vertex_capacity) {
+            resize(vertex_count*2);
+        }
+
+        slot_states.push_back(QUADBUF_SLOT_FREE);
+        slot_dirty.push_back(false);
+        slot_textures.push_back(0);
+    }
+
+    update(slot, textureid, pos, dims, colour, texcoord);
+
+    return slot;
+}
+
+void quadbuf::update(int slot, GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord) {
+
+    writeQuad(slot*4, textureid, pos, dims, colour, texcoord);
+
+    setSlot(slot, QUADBUF_SLOT_VISIBLE, textureid);
+}
+
+// hidden quads are collapsed to a point
+
+void quadbuf::hide(int slot) {
+
+    if(slot_states[slot] != QUADBUF_SLOT_VISIBLE) return;
+
+    writeQuad(slot*4, 0, vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), vec4(0.0f, 0.0f, 0.0f, 0.0f), quadbuf_default_texcoord);
+
+    setSlot(slot, QUADBUF_SLOT_HIDDEN, 0);
+}
+
+void quadbuf::free(int slot) {
+
+    if(slot_states[slot] == QUADBUF_SLOT_FREE) return;
+
+    hide(slot);
+
+    slot_states[slot] = QUADBUF_SLOT_FREE;
+
+    free_slots.push_back(slot);
+}
+
+// rebuild the texture ranges from the slots. hidden and free slots, like
+// quads without a texture, join whichever range they fall in
+
+void quadbuf::rebuildTextures() {
+
+    textures.resize(0);
+
+    bool instanced = vertex_format == QUADBUF_VERTEX_INSTANCED;
+
+    int slot_count = vertex_count / 4;
+
+    for(int i = 0; i < slot_count; i++) {
+
+        GLuint textureid = slot_textures[i];
+
+        if(slot_states[i] != QUADBUF_SLOT_VISIBLE || textureid == 0) continue;
+
+        GLenum target = GL_TEXTURE_2D;
+
+        if(instanced && !texture_layers.empty()) {
+            std::map<GLuint, quadbuf_layer>::iterator it = texture_layers.find(textureid);
+
+            if(it != texture_layers.end()) {
+                textureid = it->second.array_textureid;
+                target    = GL_TEXTURE_2D_ARRAY;
+            }
+        }
+
+        if(textures.empty() || textures.back().textureid != textureid || textures.back().target != target) {
+            textures.push_back(quadbuf_tex(i*4, textureid, target));
+        }
     }
+
+    textures_dirty = false;
+}
+
+// upload changed slots, joining nearby ones into fewer calls
+
+void quadbuf::updateRetained() {
+
+    if(!slots_dirty) return;
+
+    if(textures_dirty) rebuildTextures();
+
+    slots_dirty = false;
+
+    int slot_count = vertex_count / 4;
+
+    char* quads;
+    size_t quad_size;
+    int item_size;
+    int items_per_quad;
+
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        quads          = (char*) instance_data;
+        quad_size      = sizeof(quadbuf_instance);
+        item_size      = sizeof(quadbuf_instance);
+        items_per_quad = 1;
+    } else if(vertex_format == QUADBUF_VERTEX_COMPACT) {
+        quads          = (char*) compact_data;
+        quad_size      = sizeof(quadbuf_compact_vertex) * 4;
+        item_size      = sizeof(quadbuf_compact_vertex);
+        items_per_quad = 4;
+    } else {
+        quads          = (char*) data;
+        quad_size      = sizeof(quadbuf_vertex) * 4;
+        item_size      = sizeof(quadbuf_vertex);
+        items_per_quad = 4;
+    }
+
+    buffer_offset = 0;
+
+    // the buffer needs to grow, upload everything
+    if(buf.capacity < slot_count * items_per_quad) {
+
+        int item_capacity = vertex_capacity / 4 * items_per_quad;
+
+        buf.buffer(slot_count * items_per_quad, item_size, item_capacity, quads, GL_DYNAMIC_DRAW);
+
+        std::fill(slot_dirty.begin(), slot_dirty.end(), false);
+        return;
+    }
+
+    buf.bind();
+
+    int i = 0;
+
+    while(i < slot_count) {
+
+        if(!slot_dirty[i]) {
+            i++;
+            continue;
+        }
+
+        int start = i;
+        int end   = i + 1;
+
+        // extend the range over any clean gaps shorter than QUADBUF_RETAINED_GAP
+        for(int j = end; j < slot_count && j - end < QUADBUF_RETAINED_GAP; j++) {
+            if(slot_dirty[j]) end = j + 1;
+        }
+
+        for(int j = start; j < end; j++) slot_dirty[j] = false;
+
+        glBufferSubData(buf.buffer_type, start * quad_size, (end - start) * quad_size, quads + start * quad_size);
+
+        i = end;
+    }
+
+    buf.unbind();
 }
 
 void quadbuf::update() {
     if(vertex_count==0) return;
 
+    if(retained) {
+        updateRetained();
+        return;
+    }
+
+    applyTextureLayers();
+
+    if(sorted) sortTextures();
+    else mergeTextures();
+
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        int instance_count = vertex_count / 4;
+
+        if(buf.streaming) {
+            buffer_offset = buf.stream(instance_count * sizeof(quadbuf_instance), instance_data);
+            return;
+        }
+
+        buf.buffer( instance_count, sizeof(quadbuf_instance), vertex_capacity / 4, instance_data, GL_DYNAMIC_DRAW );
+        return;
+    }
+
+    int vertex_size = vertex_format == QUADBUF_VERTEX_COMPACT ? sizeof(quadbuf_compact_vertex) : sizeof(quadbuf_vertex);
+    GLvoid* vertex_data = vertex_format == QUADBUF_VERTEX_COMPACT ? (GLvoid*) compact_data : (GLvoid*) data;
+
+    if(buf.streaming) {
+        buffer_offset = buf.stream(vertex_count * vertex_size, vertex_data);
+        return;
+    }
+
     //recreate buffer if less than the vertex_count
-    buf.buffer( vertex_count, sizeof(quadbuf_vertex), vertex_capacity, &(data[0].pos.x), GL_DYNAMIC_DRAW );
+    buf.buffer( vertex_count, vertex_size, vertex_capacity, vertex_data, GL_DYNAMIC_DRAW );
+}
+
+void quadbuf::drawInstanced() {
+
+    Shader* shader = quadbuf_grab_instance_shader();
+
+    shader->setSampler2D("tex", 0);
+    shader->setSampler2DArray("tex_array", QUADBUF_TEXTURE_ARRAY_UNIT);
+    // enabling GL_TEXTURE_2D is per texture unit, so check it before changing unit
+    bool texturing = glIsEnabled(GL_TEXTURE_2D);
+
+    shader->setInteger("texture_mode", texturing ? quadbuf_texture_mode(GL_TEXTURE_2D) : QUADBUF_TEXTURE_NONE);
+    shader->setBool("texture_array", false);
+    shader->use();
+
+    ShaderUniform* texture_mode  = shader->getUniform("texture_mode");
+    ShaderUniform* texture_array = shader->getUniform("texture_array");
+
+    if(quadbuf_instance_program != shader->getProgram()) {
+        quadbuf_instance_program = shader->getProgram();
+
+        quadbuf_instance_attribs[0] = glGetAttribLocation(quadbuf_instance_program, "quad_rect");
+        quadbuf_instance_attribs[1] = glGetAttribLocation(quadbuf_instance_program, "quad_colour");
+        quadbuf_instance_attribs[2] = glGetAttribLocation(quadbuf_instance_program, "quad_texcoord");
+        quadbuf_instance_attribs[3] = glGetAttribLocation(quadbuf_instance_program, "quad_layer");
+    }
+
+    buf.bind();
+
+    for(int i=0;i<4;i++) {
+        glEnableVertexAttribArray(quadbuf_instance_attribs[i]);
+        glVertexAttribDivisor(quadbuf_instance_attribs[i], 1);
+    }
+
+    int instance_count = vertex_count / 4;
+
+    // ranges are drawn as they would be by the fixed function path
+    std::vector<quadbuf_tex>::iterator it = textures.begin();
+
+    int start = textures.empty() ? 0 : textures.front().start_index / 4;
+
+    while(start < instance_count) {
+
+        int end = instance_count;
+
+        if(it != textures.end()) {
+            quadbuf_tex& tex = *it;
+
+            int mode = QUADBUF_TEXTURE_NONE;
+
+            if(tex.target == GL_TEXTURE_2D_ARRAY) {
+                glActiveTexture(GL_TEXTURE0 + QUADBUF_TEXTURE_ARRAY_UNIT);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, tex.textureid);
+                if(texturing) mode = quadbuf_texture_mode(GL_TEXTURE_2D_ARRAY);
+                glActiveTexture(GL_TEXTURE0);
+            } else {
+                glBindTexture(GL_TEXTURE_2D, tex.textureid);
+                if(texturing) mode = quadbuf_texture_mode(GL_TEXTURE_2D);
+            }
+
+            it++;
+            if(it != textures.end()) end = (*it).start_index / 4;
+
+            ((IntShaderUniform*)texture_mode)->setValue(mode);
+            shader->applyUniform(texture_mode);
+
+            ((BoolShaderUniform*)texture_array)->setValue(tex.target == GL_TEXTURE_2D_ARRAY);
+            shader->applyUniform(texture_array);
+        }
+
+        // without base instance support the attributes start at the range
+        GLintptr offset = buffer_offset + start * sizeof(quadbuf_instance);
+
+        glVertexAttribPointer(quadbuf_instance_attribs[0], 4, GL_FLOAT,         GL_FALSE, sizeof(quadbuf_instance), (GLvoid*)(offset));
+        glVertexAttribPointer(quadbuf_instance_attribs[1], 4, GL_UNSIGNED_BYTE, GL_TRUE,  sizeof(quadbuf_instance), (GLvoid*)(offset + 16)); // offset pos + dims (4x4 bytes)
+        glVertexAttribPointer(quadbuf_instance_attribs[2], 4, GL_HALF_FLOAT,    GL_FALSE, sizeof(quadbuf_instance), (GLvoid*)(offset + 20)); // offset pos + dims + colour (4x4 + 4x1 bytes)
+        glVertexAttribPointer(quadbuf_instance_attribs[3], 1, GL_UNSIGNED_INT,  GL_FALSE, sizeof(quadbuf_instance), (GLvoid*)(offset + 28)); // offset pos + dims + colour + texcoord (4x4 + 4x1 + 4x2 bytes)
+
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, end - start);
+
+        start = end;
+    }
+
+    for(int i=0;i<4;i++) {
+        glVertexAttribDivisor(quadbuf_instance_attribs[i], 0);
+        glDisableVertexAttribArray(quadbuf_instance_attribs[i]);
+    }
+
+    buf.unbind();
+
+    shader->unbind();
+
+    if(buf.streaming) buf.fence();
 }
 
 void quadbuf::draw() {
     if(vertex_count==0) return;
 
+    if(vertex_format == QUADBUF_VERTEX_INSTANCED) {
+        drawInstanced();
+        return;
+    }
+
     buf.bind();
 
     glEnableClientState(GL_VERTEX_ARRAY);
     glEnableClientState(GL_COLOR_ARRAY);
     glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 
-    glVertexPointer(2,   GL_FLOAT, sizeof(quadbuf_vertex), 0);
-    glColorPointer(4,    GL_FLOAT, sizeof(quadbuf_vertex), (GLvoid*)8);  // offset pos (2x4 bytes)
-    glTexCoordPointer(2, GL_FLOAT, sizeof(quadbuf_vertex), (GLvoid*)24); // offset pos + colour (2x4 + 4x4 bytes)
+    if(vertex_format == QUADBUF_VERTEX_COMPACT) {
+        glVertexPointer(2,   GL_FLOAT,         sizeof(quadbuf_compact_vertex), (GLvoid*)(buffer_offset));
+        glColorPointer(4,    GL_UNSIGNED_BYTE, sizeof(quadbuf_compact_vertex), (GLvoid*)(buffer_offset + 8));  // offset pos (2x4 bytes)
+        glTexCoordPointer(2, GL_HALF_FLOAT,    sizeof(quadbuf_compact_vertex), (GLvoid*)(buffer_offset + 12)); // offset pos + colour (2x4 + 4x1 bytes)
+    } else {
+        glVertexPointer(2,   GL_FLOAT, sizeof(quadbuf_vertex), (GLvoid*)(buffer_offset));
+        glColorPointer(4,    GL_FLOAT, sizeof(quadbuf_vertex), (GLvoid*)(buffer_offset + 8));  // offset pos (2x4 bytes)
+        glTexCoordPointer(2, GL_FLOAT, sizeof(quadbuf_vertex), (GLvoid*)(buffer_offset + 24)); // offset pos + colour (2x4 + 4x4 bytes)
+    }
 
     int last_index = vertex_count-1;
 
@@ -181,4 +1149,6 @@ void quadbuf::draw() {
     glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 
     buf.unbind();
+
+    if(buf.streaming) buf.fence();
 }
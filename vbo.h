@@ -31,21 +31,54 @@
 
 #include <stack>
 #include <vector>
+#include <deque>
+#include <map>
 
 #include "gl.h"
 #include "vectors.h"
 #include "logger.h"
 
+// a region of a streaming buffer and the fence guarding it
+class VBOStreamRange {
+public:
+    VBOStreamRange() {};
+    VBOStreamRange(int start, int end) : start(start), end(end), sync(0) {};
+
+    int start;
+    int end;
+    GLsync sync;
+};
+
 class VBO {
+protected:
+    GLvoid* mapped;
+    int stream_offset;
+    std::deque<VBOStreamRange> stream_ranges;
+
+    void allocateStream(int size);
+    void releaseStream();
+    void waitStream(int start, int end);
 public:
     GLuint id;
     GLenum buffer_type;
 
     int capacity;
 
+    // uploads are sub-allocated from a ring instead of overwriting the
+    // buffer, so they don't wait for draws still using earlier data
+    bool streaming;
+
+    // ring is permanently mapped (GL 4.4 / ARB_buffer_storage)
+    bool persistent;
+
     VBO(GLenum buffer_type = GL_ARRAY_BUFFER) : buffer_type(buffer_type) {
         capacity = 0;
         id       = 0;
+
+        streaming     = false;
+        persistent    = false;
+        mapped        = 0;
+        stream_offset = 0;
     }
 
     ~VBO() {
@@ -57,6 +90,8 @@ public:
     }
 
     void unload() {
+        releaseStream();
+
         capacity = 0;
         if(id != 0) {
             glDeleteBuffers(1, &id);
@@ -83,6 +118,14 @@ public:
         unbind();
     }
 
+    void setStreaming(bool streaming);
+
+    // copy size bytes into the ring, returning the offset they were written to
+    GLintptr stream(int size, const GLvoid* data);
+
+    // call once the draws using the last streamed data have been issued
+    void fence();
+
     void unbind() {
         glBindBuffer(buffer_type, 0);
     }
@@ -99,27 +142,91 @@ public:
     vec2 texcoord;
 };
 
+//note this should be 16 bytes (2x4 + 4x1 + 2x2 bytes)
+class quadbuf_compact_vertex {
+public:
+    vec2 pos;
+    GLubyte colour[4];    // normalized RGBA8
+    GLushort texcoord[2]; // half floats
+};
+
+//one record per quad, expanded to vertices by a shader
+//note this should be 32 bytes (2x2x4 + 4x1 + 4x2 + 4 bytes)
+class quadbuf_instance {
+public:
+    vec2 pos;
+    vec2 dims;
+    GLubyte colour[4];    // normalized RGBA8
+    GLushort texcoord[4]; // half floats, top left and bottom right
+    GLuint layer;         // texture array layer
+};
+
+enum quadbuf_vertex_format { QUADBUF_VERTEX_FULL, QUADBUF_VERTEX_COMPACT, QUADBUF_VERTEX_INSTANCED };
+
+enum quadbuf_slot_state { QUADBUF_SLOT_FREE, QUADBUF_SLOT_HIDDEN, QUADBUF_SLOT_VISIBLE };
+
 //maintain ranges corresponding to each texture
 class quadbuf_tex {
 public:
     quadbuf_tex() {};
-    quadbuf_tex(int start_index, GLuint textureid) : start_index(start_index), textureid(textureid) {};
+    quadbuf_tex(int start_index, GLuint textureid, GLenum target = GL_TEXTURE_2D) : start_index(start_index), textureid(textureid), target(target) {};
     int start_index;
     GLuint textureid;
+    GLenum target;
+};
+
+//a texture copied into a layer of a texture array
+class quadbuf_layer {
+public:
+    quadbuf_layer() {};
+    quadbuf_layer(GLuint array_textureid, int layer) : array_textureid(array_textureid), layer(layer) {};
+    GLuint array_textureid;
+    int layer;
 };
 
 class quadbuf {
 
     quadbuf_vertex* data;
+    quadbuf_compact_vertex* compact_data;
+    quadbuf_instance* instance_data;
     int vertex_capacity;
 
+    int vertex_format;
+
     std::vector<quadbuf_tex> textures;
 
+    bool sorted;
+    std::map<GLuint, quadbuf_layer> texture_layers;
+    std::vector<char> sort_buffer;
+
+    // retained quads
+    bool retained;
+    bool slots_dirty;
+    bool textures_dirty;
+    std::vector<char> slot_states;
+    std::vector<char> slot_dirty;
+    std::vector<GLuint> slot_textures;
+    std::vector<int> free_slots;
+
     VBO buf;
+    GLintptr buffer_offset;
 
     int vertex_count;
 
     void resize(int new_size);
+    int addQuad(GLuint textureid);
+    void writeQuad(int i, GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord);
+    void setSlot(int slot, int state, GLuint textureid);
+    void relayerSlots(GLuint textureid, int layer);
+
+    void rebuildTextures();
+    void updateRetained();
+
+    void applyTextureLayers();
+    void mergeTextures();
+    void sortTextures();
+
+    void drawInstanced();
 public:
     quadbuf(int data_size = 0);
     ~quadbuf();
@@ -127,6 +234,35 @@ public:
     void unload();
     void reset();
 
+    // stream vertices through a ring buffer, for quads rebuilt every frame
+    void setStreaming(bool streaming);
+
+    // QUADBUF_VERTEX_COMPACT halves the vertex size but requires half float
+    // vertex attributes (GL 3.0), otherwise the full format is kept.
+    // QUADBUF_VERTEX_INSTANCED stores one record per quad and requires GL 3.3.
+    // quads added as four vertices must then be axis aligned rectangles
+    void setVertexFormat(int vertex_format);
+    int getVertexFormat() const { return vertex_format; };
+
+    // group quads by texture when updated so each texture is drawn once.
+    // quads using different textures may then be drawn out of order
+    void setSorted(bool sorted);
+
+    // draw quads using textureid from a layer of a GL_TEXTURE_2D_ARRAY,
+    // so quads from all the layers share one draw. instanced format only
+    void setTextureLayer(GLuint textureid, GLuint array_textureid, int layer);
+    void clearTextureLayers();
+
+    // quads are kept between frames in slots that are changed individually,
+    // and only changed slots are uploaded. retained quads are not sorted or
+    // streamed, and add() should not be mixed with them
+    void setRetained(bool retained);
+
+    int  allocate(GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord);
+    void update(int slot, GLuint textureid, const vec2& pos, const vec2& dims, const vec4& colour, const vec4& texcoord);
+    void hide(int slot);
+    void free(int slot);
+
     size_t vertices();
     size_t capacity();
     size_t texture_changes();